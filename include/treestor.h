@@ -40,6 +40,13 @@ extern "C" {
 
 enum ts_save_mode { TS_TEXT, TS_BIN };
 
+/* flags for ts_set_load_flags */
+enum {
+	TS_LOAD_LAZY		= 1,	/**< text loads parse child nodes on first access */
+	TS_LOAD_PARALLEL	= 2,	/**< parse top-level nodes on multiple threads */
+	TS_LOAD_ARENA		= 4		/**< allocate the tree from an arena (see ts_alloc_arena_tree) */
+};
+
 /** set of user-supplied I/O functions, for ts_load_io/ts_save_io */
 struct ts_io {
 	void *data;
@@ -50,36 +57,115 @@ struct ts_io {
 
 enum ts_value_type { TS_STRING, TS_NUMBER, TS_VECTOR, TS_ARRAY };
 
+struct ts_arena;
+struct ts_name_index;
+struct ts_lookup_cache;
+
 /** treestore node attribute value */
 struct ts_value {
 	enum ts_value_type type;
 
-	char *str;		/**< string values will have this set */
+	char *str;		/**< string values will have this set (see ts_get_value_str) */
 	int inum;		/**< numeric values will have this set */
 	float fnum;		/**< numeric values will have this set */
+	unsigned int flags;	/* (private) */
 
 	/** vector values (arrays containing ONLY numbers) will have this set */
 	float *vec;		/**< elements of the vector */
 	int vec_size;	/**< size of the vector (in elements), same as array_size */
 
-	/** array values (including vectors) will have this set */
+	/** array values (including vectors) will have this set. For vectors, array
+	 * is null until created by ts_get_value_array.
+	 */
 	struct ts_value *array;	/**< elements of the array */
 	int array_size;			/**< size of the array (in elements) */
+
+	struct ts_arena *arena;	/* buffers are allocated from an arena tree (private) */
+
+	char sbuf[16];	/* short strings are stored inline, str points here (private) */
 };
 
 /* choose to save files as TS_TEXT or TS_BIN */
 void ts_set_save_mode(enum ts_save_mode mode);
 enum ts_save_mode ts_get_save_mode(void);
 
+/* set load flags (TS_LOAD_*), affecting all subsequent ts_load* calls.
+ *
+ * With TS_LOAD_LAZY, the text loader only skims over the bodies of child nodes
+ * to find where they end, and each node is parsed when first accessed through
+ * ts_get_child, ts_get_attr, ts_lookup, ts_get_child_list, etc. Until then it
+ * has a name but no attributes or children, and its attr_count/child_count
+ * are 0. Code walking the child_list/attr_list fields directly must call
+ * ts_expand_node first. The input is kept in memory for as long as any of
+ * its nodes remain unexpanded (ts_load copies the file rather than keeping it
+ * mapped, so it's safe to change or truncate it after loading), and syntax
+ * errors in a node body are only reported when it's expanded. Lazily loaded
+ * trees must not be accessed from multiple threads concurrently, even if only
+ * reading.
+ *
+ * With TS_LOAD_PARALLEL, the text loader skims the root node like a lazy load,
+ * and then parses the top-level child nodes concurrently, with one thread per
+ * processor. It pays off for large files with many top-level nodes. The input
+ * is read into memory first, unless it's a memory-mapped file or buffer.
+ * Ignored if TS_LOAD_LAZY is also set.
+ *
+ * With TS_LOAD_ARENA, loads (and the push parser) return arena trees, as if
+ * constructed with ts_alloc_arena_tree and ts_alloc_node_from/attr_from.
+ *
+ * Binary files are always loaded in full; TS_LOAD_LAZY and TS_LOAD_PARALLEL
+ * only apply to text.
+ */
+void ts_set_load_flags(unsigned int flags);
+unsigned int ts_get_load_flags(void);
+
 int ts_init_value(struct ts_value *tsv);
 void ts_destroy_value(struct ts_value *tsv);
 
 struct ts_value *ts_alloc_value(void);		/**< also calls ts_init_value */
 void ts_free_value(struct ts_value *tsv);	/**< also calls ts_destroy_value */
 
+/* ts_alloc_value/attr/node get their objects from pools of fixed-size slabs,
+ * which are reused without going through malloc/free. Objects passed to the
+ * corresponding ts_free_* functions must have been allocated by them.
+ * ts_trim_pools returns the slabs which are entirely free to the system.
+ *
+ * Each thread keeps a small cache of freed objects, which it hands back to the
+ * pools when it fills up, and when the thread exits. ts_trim_pools only trims
+ * on behalf of the calling thread: it flushes that thread's cache first, but
+ * objects sitting in the caches of other live threads keep their slabs in use.
+ * To release as much as possible, call it after the other threads which used
+ * the library have exited, or from each of them.
+ */
+void ts_trim_pools(void);
+
 /** perform a deep-copy of a ts_value */
 int ts_copy_value(struct ts_value *dest, struct ts_value *src);
 
+/** returns the textual form of a string or number value, or null for
+ * vectors and arrays. Numbers don't carry a string until one is requested:
+ * the first call formats the number like the text writer (exact integers, or
+ * 9 significant digits) and caches it in tsv->str. So this, and the
+ * ts_get_attr_str/ts_lookup_str getters built on it, write to the value the
+ * first time; the conversion is done under a global lock, which makes it safe
+ * for several threads to read the same (fully expanded) tree concurrently.
+ */
+const char *ts_get_value_str(struct ts_value *tsv);
+
+/** Strings shorter than 16 bytes are stored in the ts_value itself, with str
+ * pointing into it. A ts_value must not be copied by assignment or memcpy
+ * (use ts_copy_value), or if it's moved that way, ts_value_moved must be
+ * called on the new location before str is used.
+ */
+void ts_value_moved(struct ts_value *tsv);
+
+/** returns the elements of an array or vector value, or null for scalars.
+ * Vectors only keep the float elements in vec, and the ts_value array is
+ * allocated the first time it's requested, under the same lock as
+ * ts_get_value_str. This can fail, returning null for a vector if it runs out
+ * of memory, and so can ts_get_attr_array/ts_lookup_array.
+ */
+struct ts_value *ts_get_value_array(struct ts_value *tsv);
+
 /** set a ts_value as a string */
 int ts_set_value_str(struct ts_value *tsv, const char *str);
 
@@ -101,12 +187,34 @@ int ts_set_valuev(struct ts_value *tsv, int count, ...);
 int ts_set_valuev_va(struct ts_value *tsv, int count, va_list ap);
 
 
+/* Node and attribute names are interned in a global table: each distinct name
+ * is stored once, shared by all the nodes and attributes using it, and
+ * identified by an integer atom. Looking up attributes and children by atom
+ * compares integers instead of strings, so it pays to intern frequently used
+ * names once up front.
+ *
+ * Interned names are never freed, so to keep input with endless distinct names
+ * from growing the table without bound, it stops taking new names once it uses
+ * about 16mb (TS_INTERN_LIMIT when building the library). After that, new names
+ * are stored with each node or attribute, which has name_atom 0, and freed with
+ * it; they still work with all the name lookups, except for those by atom.
+ * ts_set_intern_limit changes the limit (in bytes, 0 for none), and only
+ * affects names interned afterwards.
+ */
+int ts_intern(const char *name);	/**< returns the atom for name, 0 if the table is full, -1 on failure */
+const char *ts_atom_name(int atom);	/**< returns null for invalid atoms */
+void ts_set_intern_limit(long bytes);
+
 /** treestore node attribute */
 struct ts_attr {
-	char *name;
+	char *name;		/**< set with ts_set_attr_name, don't modify in place */
+	int name_atom;	/**< interned name (see ts_intern), 0 for names not interned */
 	struct ts_value val;
 
 	struct ts_attr *next;
+	struct ts_node *parent;	/**< node the attribute is attached to, if any */
+
+	struct ts_arena *arena;	/* allocated from an arena tree (private) */
 };
 
 int ts_init_attr(struct ts_attr *attr);
@@ -118,13 +226,18 @@ void ts_free_attr(struct ts_attr *attr);	/**< also calls ts_destroy_attr */
 /** perform a deep-copy of a ts_attr */
 int ts_copy_attr(struct ts_attr *dest, struct ts_attr *src);
 
+/* interns the name (see ts_intern), so every distinct name set stays in the
+ * intern table for good, even after the attribute is freed, up to the intern
+ * limit.
+ */
 int ts_set_attr_name(struct ts_attr *attr, const char *name);
 
 
 
 /** treestore node */
 struct ts_node {
-	char *name;
+	char *name;		/**< set with ts_set_node_name, don't modify in place */
+	int name_atom;	/**< interned name (see ts_intern), 0 for names not interned */
 
 	int attr_count;
 	struct ts_attr *attr_list, *attr_tail;
@@ -134,6 +247,16 @@ struct ts_node {
 	struct ts_node *parent;
 
 	struct ts_node *next;	/* next sibling */
+
+	/* name indexes of large nodes, and the next sibling with the same name
+	 * when the parent has a child_index (private)
+	 */
+	struct ts_name_index *attr_index, *child_index;
+	struct ts_node *next_dup;
+
+	struct ts_lookup_cache *lcache;	/* see ts_set_lookup_cache (private) */
+	struct ts_lazy *lazy;	/* unparsed body of a lazily loaded node (private) */
+	struct ts_arena *arena;	/* allocated from an arena tree (private) */
 };
 
 int ts_init_node(struct ts_node *node);
@@ -145,10 +268,50 @@ void ts_free_node(struct ts_node *n);	/**< also calls ts_destroy_node */
 /** recursively destroy all the nodes of the tree */
 void ts_free_tree(struct ts_node *tree);
 
+/* Arena trees: nodes, attributes, and the contents of their values are bump
+ * allocated from large blocks owned by the root, and ts_free_tree on the root
+ * releases everything at once instead of walking the tree. Trees can be
+ * modified as usual; values of arena attributes keep allocating from the
+ * arena when set with the ts_set_value* functions, and regular heap nodes and
+ * attributes can be added to them, in which case they're freed individually
+ * along with the tree.
+ *
+ * Arena nodes and attributes stay in the arena even if removed from the tree,
+ * and become invalid when the root is freed; calling ts_free_node/ts_free_attr
+ * or ts_free_tree on them only frees any heap objects attached to them.
+ * Values copied wholesale into an arena attribute (attr->val = val) aren't
+ * tracked, and leak when the arena is freed.
+ */
+struct ts_node *ts_alloc_arena_tree(void);	/**< allocates the root of a new arena tree */
+/* allocate a node or attribute from the arena of the tree which includes the
+ * supplied node. Falls back to ts_alloc_node/ts_alloc_attr for regular trees.
+ */
+struct ts_node *ts_alloc_node_from(struct ts_node *tree);
+struct ts_attr *ts_alloc_attr_from(struct ts_node *tree);
+
+/* interns the name like ts_set_attr_name */
 int ts_set_node_name(struct ts_node *node, const char *name);
 
+/* parse the body of a lazily loaded node (see TS_LOAD_LAZY). Does nothing for
+ * nodes which are already expanded. ts_expand_tree expands the whole subtree.
+ * Return 0 on success, -1 if the node body fails to parse, in which case the
+ * node is left empty.
+ */
+int ts_expand_node(struct ts_node *node);
+int ts_expand_tree(struct ts_node *tree);
+
+/* Nodes with many attributes or children keep hash indexes of their names,
+ * which are maintained by ts_add_attr/ts_remove_attr, ts_add_child/
+ * ts_remove_child and ts_set_attr_name/ts_set_node_name. Attributes and
+ * children must not be linked or unlinked by manipulating the lists directly.
+ */
 void ts_add_attr(struct ts_node *node, struct ts_attr *attr);
+/* unlink an attribute from the node without freeing it. Returns -1 if it isn't
+ * one of the node's attributes.
+ */
+int ts_remove_attr(struct ts_node *node, struct ts_attr *attr);
 struct ts_attr *ts_get_attr(struct ts_node *node, const char *name);
+struct ts_attr *ts_get_attr_atom(struct ts_node *node, int atom);
 
 const char *ts_get_attr_str(struct ts_node *node, const char *aname,
 		const char *def_val TS_DEFVAL(0));
@@ -165,6 +328,27 @@ struct ts_value *ts_get_attr_array(struct ts_node *node, const char *aname,
 void ts_add_child(struct ts_node *node, struct ts_node *child);
 int ts_remove_child(struct ts_node *node, struct ts_node *child);
 struct ts_node *ts_get_child(struct ts_node *node, const char *name);
+struct ts_node *ts_get_child_atom(struct ts_node *node, int atom);
+/* returns the next child of the same parent with the same name, to iterate
+ * over all the children with a given name:
+ *   for(c = ts_get_child(node, "mesh"); c; c = ts_get_next_child(c)) ...
+ */
+struct ts_node *ts_get_next_child(struct ts_node *child);
+
+/* heads of the attribute and child lists, for iterating with the next
+ * pointers. Unlike accessing the list fields directly, these expand lazily
+ * loaded nodes first.
+ */
+struct ts_attr *ts_get_attr_list(struct ts_node *node);
+struct ts_node *ts_get_child_list(struct ts_node *node);
+
+/* All loaders (and the push parser) intern the node and attribute names they
+ * read, so each distinct name in a loaded file takes up space in the intern
+ * table until the process exits, after the tree is freed. Files with a fixed
+ * vocabulary of names cost nothing extra to reload; input with unbounded name
+ * sets (user supplied keys, generated names) fills the table up to its limit,
+ * and the names past it are stored with the tree (see ts_set_intern_limit).
+ */
 
 /* load/save by opening the specified file */
 struct ts_node *ts_load(const char *fname);
@@ -174,10 +358,60 @@ int ts_save(struct ts_node *tree, const char *fname);
 struct ts_node *ts_load_file(FILE *fp);
 int ts_save_file(struct ts_node *tree, FILE *fp);
 
-/* load/save using custom I/O functions */
+/* load/save using custom I/O functions. Loading tells binary files from text
+ * by their first few bytes, and reads the input only once, so it works on
+ * pipes and other streams which can't seek.
+ */
 struct ts_node *ts_load_io(struct ts_io *io);
 int ts_save_io(struct ts_node *tree, struct ts_io *io);
 
+/* load from a memory buffer. The text parser works directly on the buffer
+ * without copying it, and ts_load uses this on a memory-mapped file when the
+ * platform supports it.
+ */
+struct ts_node *ts_load_mem(const void *buf, size_t len);
+
+
+/** callbacks for event-driven parsing with ts_parse*. Any of them may be null.
+ * Names and values passed to the callbacks are only valid for the duration of
+ * the call (use ts_copy_value to keep a value around). Returning -1 from any
+ * callback aborts parsing.
+ */
+struct ts_parse_callbacks {
+	void *data;	/**< passed as the last argument to every callback */
+
+	int (*begin_node)(const char *name, void *uptr);
+	int (*attr)(const char *name, struct ts_value *val, void *uptr);
+	int (*end_node)(void *uptr);
+};
+
+/* Stream through a text file calling the supplied callbacks, without building
+ * a tree. Memory use doesn't depend on the size of the input.
+ * Return 0 on success, -1 on failure.
+ */
+int ts_parse(const char *fname, struct ts_parse_callbacks *cb);
+int ts_parse_file(FILE *fp, struct ts_parse_callbacks *cb);
+int ts_parse_io(struct ts_io *io, struct ts_parse_callbacks *cb);
+int ts_parse_mem(const void *buf, size_t len, struct ts_parse_callbacks *cb);
+
+
+/** push parser for the text format: the input is fed to it in arbitrary
+ * chunks as it becomes available, instead of being pulled through a ts_io.
+ */
+struct ts_parser;
+
+struct ts_parser *ts_alloc_parser(void);
+void ts_free_parser(struct ts_parser *p);
+
+/* feed the next chunk of input. Returns -1 on parse errors, in which case any
+ * further calls to ts_parser_feed fail, until ts_parser_finish is called.
+ */
+int ts_parser_feed(struct ts_parser *p, const void *buf, size_t len);
+/* signal the end of the input, and return the tree (owned by the caller), or
+ * null on failure. Afterwards the parser can be reused for another document.
+ */
+struct ts_node *ts_parser_finish(struct ts_parser *p);
+
 
 struct ts_attr *ts_lookup(struct ts_node *root, const char *path);
 const char *ts_lookup_str(struct ts_node *root, const char *path,
@@ -191,6 +425,61 @@ float *ts_lookup_vec(struct ts_node *root, const char *path,
 struct ts_value *ts_lookup_array(struct ts_node *root, const char *path,
 		struct ts_value *def_val TS_DEFVAL(0));
 
+/* Lookup cache: remember the results of ts_lookup* calls on root, including
+ * failed lookups, in a table with room for about size paths. Adding, removing
+ * or renaming attributes and nodes anywhere under root invalidates the cached
+ * results, but changing attribute values doesn't. A size of 0 removes the
+ * cache. Lookups on a tree with a cache must not run concurrently.
+ * Returns 0 on success, -1 on failure.
+ */
+int ts_set_lookup_cache(struct ts_node *root, int size);
+
+/* Compiled paths: ts_compile_path splits a path once, and interns and hashes
+ * its segments, so that looking it up repeatedly with ts_lookup_compiled*
+ * does no string processing, and compares atoms instead of names.
+ * ts_compile_path returns null on failure, or if the path has less than two
+ * segments. Compiled paths can be shared between threads.
+ */
+struct ts_path;
+
+struct ts_path *ts_compile_path(const char *path);
+void ts_free_path(struct ts_path *path);
+
+struct ts_attr *ts_lookup_compiled(struct ts_node *root, const struct ts_path *path);
+const char *ts_lookup_compiled_str(struct ts_node *root, const struct ts_path *path,
+		const char *def_val TS_DEFVAL(0));
+float ts_lookup_compiled_num(struct ts_node *root, const struct ts_path *path,
+		float def_val TS_DEFVAL(0.0f));
+int ts_lookup_compiled_int(struct ts_node *root, const struct ts_path *path,
+		int def_val TS_DEFVAL(0));
+float *ts_lookup_compiled_vec(struct ts_node *root, const struct ts_path *path,
+		float *def_val TS_DEFVAL(0));
+struct ts_value *ts_lookup_compiled_array(struct ts_node *root, const struct ts_path *path,
+		struct ts_value *def_val TS_DEFVAL(0));
+
+/* Queries: find every node matching a dotted pattern, where the first segment
+ * matches root, as with ts_lookup paths. A segment is a node name, * to match
+ * any node, or ** to match any number of nested nodes, including none:
+ *   "scene.*.mesh" meshes of the children of scene
+ *   "scene.**.mesh" meshes anywhere under scene
+ * Name and * segments can be followed by a predicate on the node's attributes:
+ * [attr] requires the attribute to exist, and [attr=value] to have that value,
+ * compared numerically if both are numbers. Values may be quoted.
+ *
+ * ts_query_next returns the matches one at a time in document order, each
+ * node once, and null when there are no more. No result list is built, and
+ * the query follows the child name indexes where it can. The tree must not be
+ * modified while iterating. ts_query_reset restarts the query on a new root.
+ * ts_query returns null if the query is invalid, or on allocation failure.
+ */
+struct ts_query;
+
+struct ts_query *ts_query(struct ts_node *root, const char *query);
+void ts_query_free(struct ts_query *q);
+
+struct ts_node *ts_query_next(struct ts_query *q);
+void ts_query_reset(struct ts_query *q, struct ts_node *root);
+
 
 #ifdef __cplusplus
 }
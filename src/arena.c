@@ -0,0 +1,133 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+#include <stdlib.h>
+#include "arena.h"
+
+#define ARENA_ALIGN			8
+#define ARENA_FIRST_BLOCK	16384
+#define ARENA_MAX_BLOCK		(1 << 20)
+
+struct arena_block {
+	struct arena_block *next;
+	double pad;		/* keep the data following the header aligned */
+};
+
+static void *add_block(struct ts_arena *arena, size_t size);
+
+
+struct ts_arena *ts_arena_create(struct ts_arena *owner)
+{
+	struct ts_arena *arena;
+
+	if(!(arena = calloc(1, sizeof *arena))) {
+		return 0;
+	}
+	arena->next_size = ARENA_FIRST_BLOCK;
+
+	if(owner) {
+		arena->owner = owner;
+		arena->next = owner->subs;
+		owner->subs = arena;
+	} else {
+		arena->owner = arena;
+	}
+	return arena;
+}
+
+void ts_arena_destroy(struct ts_arena *arena)
+{
+	struct arena_block *blk;
+
+	while(arena->subs) {
+		struct ts_arena *sub = arena->subs;
+		arena->subs = sub->next;
+		ts_arena_destroy(sub);
+	}
+
+	while(arena->blocks) {
+		blk = arena->blocks;
+		arena->blocks = blk->next;
+		free(blk);
+	}
+	free(arena);
+}
+
+void *ts_arena_alloc(struct ts_arena *arena, size_t size)
+{
+	void *ptr;
+	size_t bsz;
+	struct arena_block *blk;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if(size > (size_t)(arena->end - arena->ptr)) {
+		bsz = arena->next_size;
+
+		/* large allocations get a block of their own, without abandoning the
+		 * rest of the current block
+		 */
+		if(size > bsz / 4) {
+			if(!(blk = malloc(sizeof *blk + size))) {
+				return 0;
+			}
+			if(arena->blocks) {
+				blk->next = arena->blocks->next;
+				arena->blocks->next = blk;
+			} else {
+				blk->next = 0;
+				arena->blocks = blk;
+			}
+			return blk + 1;
+		}
+
+		if(!(ptr = add_block(arena, bsz))) {
+			return 0;
+		}
+		if(arena->next_size < ARENA_MAX_BLOCK) {
+			arena->next_size *= 2;
+		}
+	}
+
+	ptr = arena->ptr;
+	arena->ptr += size;
+	return ptr;
+}
+
+static void *add_block(struct ts_arena *arena, size_t size)
+{
+	struct arena_block *blk;
+
+	if(!(blk = malloc(sizeof *blk + size))) {
+		return 0;
+	}
+	blk->next = arena->blocks;
+	arena->blocks = blk;
+
+	arena->ptr = (char*)(blk + 1);
+	arena->end = arena->ptr + size;
+	return blk;
+}
@@ -0,0 +1,62 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+#ifndef TS_ARENA_H_
+#define TS_ARENA_H_
+
+#include <stdlib.h>
+
+/* chunked bump allocator backing arena trees. Allocations are only released
+ * all at once, when the arena is destroyed.
+ *
+ * The parallel loader gives each thread a sub-arena to allocate from, owned by
+ * the arena of the tree, and destroyed along with it. Objects are stamped with
+ * the arena they were allocated from, and belong to the same tree if the
+ * owners match.
+ */
+struct ts_arena {
+	struct arena_block *blocks;
+	char *ptr, *end;
+	size_t next_size;
+
+	struct ts_arena *owner;			/* self, unless it's a sub-arena */
+	struct ts_arena *subs, *next;	/* sub-arenas of an owner */
+
+	/* the following are only used in the owner */
+	struct ts_node *root;	/* the node which frees the arena */
+	int nforeign;			/* objects hanging off the tree, which aren't in the arena */
+};
+
+#define ARENA_OWNER(a)	((a) ? (a)->owner : 0)
+
+/* pass a null owner to create a new top-level arena */
+struct ts_arena *ts_arena_create(struct ts_arena *owner);
+/* destroys sub-arenas too */
+void ts_arena_destroy(struct ts_arena *arena);
+
+void *ts_arena_alloc(struct ts_arena *arena, size_t size);
+
+#endif	/* TS_ARENA_H_ */
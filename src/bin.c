@@ -27,8 +27,11 @@ OF SUCH DAMAGE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "treestor.h"
 #include "dynarr.h"
+#include "arena.h"
+#include "intern.h"
 
 #if defined(__GNUC__) || (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L)
 #include <stdint.h>
@@ -50,117 +53,1072 @@ typedef unsigned short uint16_t;
 typedef unsigned long uint32_t;
 #endif
 
+/* The binary format is made of chunks, each starting with a 4-character id and
+ * the size of the data following the chunk header. Everything is stored in
+ * little-endian byte order.
+ *
+ *   chunk      u32 id, u32 size
+ *   STRT       u32 count, count zero-terminated strings
+ *   NODE       u32 name, u32 attribute count, u32 child count,
+ *              attributes, child NODE chunks
+ *   attribute  u32 name, value
+ *   value      u8 type, followed by:
+ *     string   u32 length, characters (not terminated)
+ *     strref   u32 index of the string in the string table
+ *     int      i32
+ *     float    f32
+ *     vector   u32 count, count f32
+ *     array    u32 count, count values
+ *
+ * A file starts with a header: the magic bytes 7f 'T' 'S' 'B' and a u32 format
+ * version. A STRT chunk with all the node and attribute names follows, and
+ * then the NODE chunk of the root. Names are indices into the string table, and
+ * short string values are stored there too, so that repeated ones are shared.
+ */
+#define CHUNK_ID(a, b, c, d) \
+	((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+#define ID_STRT		CHUNK_ID('S', 'T', 'R', 'T')
+#define ID_NODE		CHUNK_ID('N', 'O', 'D', 'E')
+
+#define FILE_MAGIC		"\x7fTSB"
+#define FILE_VERSION	1
+#define FILE_HDR_SIZE	8
+
+#define CHUNK_HDR_SIZE	8
+#define NODE_HDR_SIZE	12
+#define MAX_CHUNK_SIZE	0xffffffffUL
+
+enum { BVAL_STR, BVAL_INT, BVAL_FLOAT, BVAL_VEC, BVAL_ARR, BVAL_STRREF };
+
+/* string values shorter than this go in the string table */
+#define STRREF_MAX_LEN	16
+
+/* limit on nested nodes and arrays, to keep the recursive reader (and writer)
+ * from running out of stack on crafted files
+ */
+#define MAX_DEPTH	1024
+
+/* the least space an attribute or a child node can take in a node chunk */
+#define MIN_ATTR_SIZE	9
+#define MIN_CHILD_SIZE	(CHUNK_HDR_SIZE + NODE_HDR_SIZE)
+
 struct fnode {
-	long offs, size, nameid;
+	long size, nameid;
 	struct ts_node *tsnode;
 
+	long *attr_nameid;	/* name ids of the attributes, in list order */
+	int attr_count, child_count;
+	long attr_size;		/* size of all the attributes */
+
 	struct fnode *chead, *ctail;
 	struct fnode *next;
 };
 
+/* the string table refers to the strings in the tree being saved, and finds
+ * them through a hash table with linear probing, which keeps it half empty
+ */
+struct strtab_slot {
+	unsigned int hash;
+	int idx;	/* index in str plus one, 0 for empty slots */
+};
+
 struct string_table {
-	char **str;
+	const char **str;
+	long size;	/* total size of the strings, including terminators */
+
+	struct strtab_slot *slot;
+	int nslots;
 };
 
-static struct fnode *mkftree(struct ts_node *tree, struct string_table *strtab);
+/* strings of a loaded string table are only interned when used as names, so
+ * that string values don't end up in the global intern table
+ */
+struct bin_string {
+	const char *str;	/* points into the input */
+	long len;
+	const char *name;
+	int atom;			/* 0 until interned */
+};
+
+/* the loader reads the string table and the root chunk into memory, or uses
+ * them in place when loading from a memory buffer, and parses from there
+ */
+struct reader {
+	const unsigned char *ptr, *end;
+
+	int nstr;
+	struct bin_string *str;
+
+	struct ts_arena *arena;	/* arena of the tree, for TS_LOAD_ARENA */
+	int depth;
+};
+
+#define WRBUF_SIZE	65536
+
+/* output is buffered, so that the ts_io write function gets large blocks */
+struct writer {
+	struct ts_io *io;
+	unsigned char *buf;
+	long len;
+
+	struct string_table *strtab;
+};
+
+int ts_value_is_int(struct ts_value *tsv);
+char *ts_alloc_value_str(struct ts_value *tsv, size_t len);
+struct ts_node *ts_alloc_node_arena(struct ts_arena *arena);
+struct ts_attr *ts_alloc_attr_arena(struct ts_arena *arena);
+
+static struct ts_node *load_tree(const unsigned char *strt, long strt_size,
+		const unsigned char *data, long size);
+static int read_strtab(struct reader *rd, const unsigned char *strt, long size);
+static int get_name(struct reader *rd, uint32_t id, const char **name);
+static int read_node(struct reader *rd, struct ts_node *node);
+static int read_value(struct reader *rd, struct ts_value *tsv);
+static int check_file_hdr(const unsigned char *hdr);
+static int read_hdr(struct ts_io *io, unsigned char *hdr, uint32_t id, uint32_t *size);
+static long read_full(struct ts_io *io, void *buf, long sz);
+static unsigned char *read_chunk(struct ts_io *io, const unsigned char *pre, int presz,
+		uint32_t size, long *lenp);
+static uint32_t get_u32(const unsigned char *p);
+
+static struct fnode *mkftree(struct ts_node *tree, struct string_table *strtab, int depth);
+static void free_ftree(struct fnode *fnode);
+static long value_size(struct ts_value *val, struct string_table *strtab, int depth);
+static int write_node(struct writer *wr, struct fnode *fnode);
+static int write_value(struct writer *wr, struct ts_value *val);
+static int wr_flush(struct writer *wr);
+static int wr_bytes(struct writer *wr, const void *data, long sz);
+static int wr_u8(struct writer *wr, unsigned int x);
+static int wr_u32(struct writer *wr, uint32_t x);
+static int wr_f32(struct writer *wr, float x);
+static int little_endian(void);
 static int init_strtab(struct string_table *strtab);
 static void destroy_strtab(struct string_table *strtab);
 static int stratom(struct string_table *strtab, const char *name);
+static int grow_strtab(struct string_table *strtab);
+
 
+/* the first few bytes are enough to tell binary files apart from text, which
+ * can't start with the 0x7f byte of the magic
+ */
+int ts_bin_check(const void *buf, size_t len)
+{
+	return len >= 4 && memcmp(buf, FILE_MAGIC, 4) == 0;
+}
 
 struct ts_node *ts_bin_load(struct ts_io *io)
 {
-	return 0;
+	unsigned char hdr[CHUNK_HDR_SIZE];
+	unsigned char *strt = 0, *data = 0;
+	uint32_t size;
+	long strt_len, data_len;
+	struct ts_node *root = 0;
+
+	if(read_full(io, hdr, FILE_HDR_SIZE) < FILE_HDR_SIZE) {
+		fprintf(stderr, "ts_bin_load: unexpected end of file\n");
+		return 0;
+	}
+	if(check_file_hdr(hdr) == -1 || read_hdr(io, hdr, ID_STRT, &size) == -1) {
+		return 0;
+	}
+	if(!(strt = read_chunk(io, 0, 0, size, &strt_len))) {
+		goto end;
+	}
+
+	/* the root node is read whole, including its chunk header */
+	if(read_hdr(io, hdr, ID_NODE, &size) == -1) {
+		goto end;
+	}
+	if(!(data = read_chunk(io, hdr, CHUNK_HDR_SIZE, size, &data_len))) {
+		goto end;
+	}
+
+	root = load_tree(strt, strt_len, data, data_len);
+
+end:
+	free(strt);
+	free(data);
+	return root;
+}
+
+/* like ts_bin_load, but parses the data in place */
+struct ts_node *ts_bin_load_mem(const void *buf, size_t len)
+{
+	const unsigned char *strt = buf;
+	size_t strt_size;
+
+	if(len < FILE_HDR_SIZE + CHUNK_HDR_SIZE) {
+		fprintf(stderr, "ts_bin_load: unexpected end of file\n");
+		return 0;
+	}
+	if(len > LONG_MAX) {
+		fprintf(stderr, "ts_bin_load: input too large\n");
+		return 0;
+	}
+	if(check_file_hdr(strt) == -1) {
+		return 0;
+	}
+	strt += FILE_HDR_SIZE;
+	len -= FILE_HDR_SIZE;
+
+	if(get_u32(strt) != ID_STRT) {
+		fprintf(stderr, "ts_bin_load: missing string table\n");
+		return 0;
+	}
+	strt_size = get_u32(strt + 4);
+	if(strt_size > len - CHUNK_HDR_SIZE) {
+		fprintf(stderr, "ts_bin_load: unexpected end of file\n");
+		return 0;
+	}
+	strt += CHUNK_HDR_SIZE;
+	len -= CHUNK_HDR_SIZE + strt_size;
+
+	return load_tree(strt, strt_size, strt + strt_size, len);
 }
 
 int ts_bin_save(struct ts_node *tree, struct ts_io *io)
 {
-	int res = -1;
-	struct fnode *fileroot;
+	int i, count, res = -1;
+	long strt_size;
+	struct fnode *fileroot = 0;
 	struct string_table strtab;
+	struct writer wr;
+
+	if(!tree) return -1;
 
 	if(init_strtab(&strtab) == -1) {
 		return -1;
 	}
+	wr.buf = 0;
+
+	if(!(fileroot = mkftree(tree, &strtab, 0))) {
+		goto end;
+	}
+
+	/* the string table goes first, followed by the root node */
+	strt_size = 4 + strtab.size;
+	if((unsigned long)strt_size > MAX_CHUNK_SIZE) {
+		fprintf(stderr, "ts_bin_save: string table too large\n");
+		goto end;
+	}
 
-	if(!(fileroot = mkftree(tree, &strtab))) {
+	if(!(wr.buf = malloc(WRBUF_SIZE))) {
 		goto end;
 	}
+	wr.io = io;
+	wr.len = 0;
+	wr.strtab = &strtab;
 
-	/* ... */
+	if(wr_bytes(&wr, FILE_MAGIC, 4) == -1 || wr_u32(&wr, FILE_VERSION) == -1) {
+		goto end;
+	}
 
+	count = ts_dynarr_size(strtab.str);
+	if(wr_u32(&wr, ID_STRT) == -1 || wr_u32(&wr, strt_size) == -1 || wr_u32(&wr, count) == -1) {
+		goto end;
+	}
+	for(i=0; i<count; i++) {
+		if(wr_bytes(&wr, strtab.str[i], strlen(strtab.str[i]) + 1) == -1) {
+			goto end;
+		}
+	}
+
+	if(write_node(&wr, fileroot) == -1 || wr_flush(&wr) == -1) {
+		goto end;
+	}
 	res = 0;
+
 end:
+	free(wr.buf);
+	free_ftree(fileroot);
 	destroy_strtab(&strtab);
 	return res;
 }
 
 
-static struct fnode *mkftree(struct ts_node *tree, struct string_table *strtab)
+static struct ts_node *load_tree(const unsigned char *strt, long strt_size,
+		const unsigned char *data, long size)
+{
+	struct reader rd;
+	struct ts_node *root = 0;
+
+	memset(&rd, 0, sizeof rd);
+	if(read_strtab(&rd, strt, strt_size) == -1) {
+		goto end;
+	}
+
+	if(ts_get_load_flags() & TS_LOAD_ARENA) {
+		if(!(root = ts_alloc_arena_tree())) {
+			perror("ts_bin_load: failed to allocate arena tree");
+			goto end;
+		}
+		rd.arena = root->arena;
+	} else if(!(root = ts_alloc_node())) {
+		perror("ts_bin_load: failed to allocate treestore node");
+		goto end;
+	}
+
+	rd.ptr = data;
+	rd.end = data + size;
+	if(read_node(&rd, root) == -1) {
+		ts_free_tree(root);
+		root = 0;
+		goto end;
+	}
+	if(rd.ptr != rd.end) {
+		fprintf(stderr, "ts_bin_load: ignoring trailing data\n");
+	}
+
+end:
+	free(rd.str);
+	return root;
+}
+
+static int read_strtab(struct reader *rd, const unsigned char *strt, long size)
+{
+	int i;
+	uint32_t count;
+	const unsigned char *ptr, *end, *zero;
+
+	if(size < 4 || (count = get_u32(strt)) > size - 4) {
+		goto corrupt;
+	}
+	if(!(rd->str = malloc((count ? count : 1) * sizeof *rd->str))) {
+		perror("ts_bin_load: failed to allocate string table");
+		return -1;
+	}
+
+	ptr = strt + 4;
+	end = strt + size;
+	for(i=0; i<count; i++) {
+		if(!(zero = memchr(ptr, 0, end - ptr))) {
+			goto corrupt;
+		}
+		rd->str[i].str = (const char*)ptr;
+		rd->str[i].len = zero - ptr;
+		rd->str[i].atom = 0;
+		ptr = zero + 1;
+	}
+	rd->nstr = count;
+	return 0;
+
+corrupt:
+	fprintf(stderr, "ts_bin_load: invalid string table\n");
+	return -1;
+}
+
+/* returns the atom of a name in the string table, interning it the first
+ * time. If the intern table is full, returns 0 with a copy of the name, which
+ * the caller must hand to the node or attribute it's for.
+ */
+static int get_name(struct reader *rd, uint32_t id, const char **name)
+{
+	struct bin_string *bs;
+
+	if(id >= rd->nstr) {
+		fprintf(stderr, "ts_bin_load: invalid name\n");
+		return -1;
+	}
+	bs = rd->str + id;
+
+	if(!bs->atom) {
+		if((bs->atom = ts_intern_len(bs->str, bs->len, ts_intern_hash(bs->str, bs->len), &bs->name)) <= 0) {
+			if(bs->atom == -1 || !(*name = ts_name_copy(rd->arena, bs->str, bs->len))) {
+				bs->atom = 0;
+				return -1;
+			}
+			return 0;
+		}
+	}
+	*name = bs->name;
+	return bs->atom;
+}
+
+#define NEED(sz) \
+	do { \
+		if((unsigned long)(rd->end - rd->ptr) < (unsigned long)(sz)) goto corrupt; \
+	} while(0)
+
+/* reads a node chunk into node. Attributes and children are linked through
+ * ts_add_attr/ts_add_child, which keep the parent pointers and name indexes
+ * coherent.
+ */
+static int read_node(struct reader *rd, struct ts_node *node)
+{
+	int i, atom;
+	uint32_t size, nameid, nattr, nchild;
+	const char *name;
+	const unsigned char *end;
+	const unsigned char *parent_end = rd->end;
+	struct ts_attr *attr;
+	struct ts_node *child;
+
+	NEED(CHUNK_HDR_SIZE + NODE_HDR_SIZE);
+	if(get_u32(rd->ptr) != ID_NODE) {
+		goto corrupt;
+	}
+	size = get_u32(rd->ptr + 4);
+	rd->ptr += CHUNK_HDR_SIZE;
+	NEED(size);
+	if(size < NODE_HDR_SIZE) {
+		goto corrupt;
+	}
+	end = rd->ptr + size;
+
+	nameid = get_u32(rd->ptr);
+	nattr = get_u32(rd->ptr + 4);
+	nchild = get_u32(rd->ptr + 8);
+	rd->ptr += NODE_HDR_SIZE;
+
+	/* reject counts which can't fit in the chunk before allocating anything */
+	size -= NODE_HDR_SIZE;
+	if(nattr > size / MIN_ATTR_SIZE || nchild > (size - nattr * MIN_ATTR_SIZE) / MIN_CHILD_SIZE) {
+		goto corrupt;
+	}
+
+	if((atom = get_name(rd, nameid, &name)) == -1) {
+		return -1;
+	}
+	node->name = (char*)name;
+	node->name_atom = atom;
+
+	/* nothing inside the chunk may extend past its end */
+	rd->end = end;
+
+	for(i=0; i<nattr; i++) {
+		NEED(4);
+		nameid = get_u32(rd->ptr);
+		rd->ptr += 4;
+
+		if(!(attr = ts_alloc_attr_arena(rd->arena))) {
+			perror("ts_bin_load: failed to allocate attribute");
+			goto err;
+		}
+		if((atom = get_name(rd, nameid, &name)) == -1) {
+			ts_free_attr(attr);
+			goto err;
+		}
+		attr->name = (char*)name;
+		attr->name_atom = atom;
+		if(read_value(rd, &attr->val) == -1) {
+			ts_free_attr(attr);
+			goto err;
+		}
+		ts_add_attr(node, attr);
+	}
+
+	if(nchild > 0 && rd->depth >= MAX_DEPTH) {
+		fprintf(stderr, "ts_bin_load: nodes nested too deeply\n");
+		goto err;
+	}
+	rd->depth++;
+	for(i=0; i<nchild; i++) {
+		if(!(child = ts_alloc_node_arena(rd->arena))) {
+			perror("ts_bin_load: failed to allocate treestore node");
+			rd->depth--;
+			goto err;
+		}
+		if(read_node(rd, child) == -1) {
+			ts_free_tree(child);
+			rd->depth--;
+			goto err;
+		}
+		ts_add_child(node, child);
+	}
+	rd->depth--;
+
+	if(rd->ptr != end) {
+		goto corrupt;
+	}
+	rd->end = parent_end;
+	return 0;
+
+corrupt:
+	fprintf(stderr, "ts_bin_load: invalid node chunk\n");
+err:
+	rd->end = parent_end;
+	return -1;
+}
+
+static int read_value(struct reader *rd, struct ts_value *tsv)
+{
+	int i, type;
+	uint32_t count;
+	size_t size;
+	union { uint32_t u; float f; } num;
+
+	NEED(5);
+	type = *rd->ptr;
+	count = get_u32(rd->ptr + 1);
+	rd->ptr += 5;
+
+	switch(type) {
+	case BVAL_STR:
+		NEED(count);
+		if(!(tsv->str = ts_alloc_value_str(tsv, count))) {
+			goto nomem;
+		}
+		memcpy(tsv->str, rd->ptr, count);
+		tsv->str[count] = 0;
+		tsv->type = TS_STRING;
+		rd->ptr += count;
+		break;
+
+	case BVAL_STRREF:
+		if(count >= rd->nstr) {
+			goto corrupt;
+		}
+		if(!(tsv->str = ts_alloc_value_str(tsv, rd->str[count].len))) {
+			goto nomem;
+		}
+		memcpy(tsv->str, rd->str[count].str, rd->str[count].len + 1);
+		tsv->type = TS_STRING;
+		break;
+
+	case BVAL_INT:
+		ts_set_valuei(tsv, (int32_t)count);
+		break;
+
+	case BVAL_FLOAT:
+		num.u = count;
+		ts_set_valuef(tsv, num.f);
+		break;
+
+	case BVAL_VEC:
+		if(count > (unsigned long)(rd->end - rd->ptr) / 4) {
+			goto corrupt;
+		}
+		size = count * sizeof *tsv->vec;
+		if(!(tsv->vec = tsv->arena ? ts_arena_alloc(tsv->arena, size) : malloc(size ? size : 1))) {
+			goto nomem;
+		}
+		if(little_endian()) {
+			memcpy(tsv->vec, rd->ptr, size);
+		} else {
+			for(i=0; i<count; i++) {
+				num.u = get_u32(rd->ptr + i * 4);
+				tsv->vec[i] = num.f;
+			}
+		}
+		tsv->type = TS_VECTOR;
+		tsv->vec_size = tsv->array_size = count;
+		rd->ptr += count * 4;
+		break;
+
+	case BVAL_ARR:
+		/* every element takes at least 5 bytes */
+		if(count > (unsigned long)(rd->end - rd->ptr) / 5) {
+			goto corrupt;
+		}
+		/* elements are read in place, so they never have to be moved */
+		size = count * sizeof *tsv->array;
+		if(!(tsv->array = tsv->arena ? ts_arena_alloc(tsv->arena, size) : malloc(size ? size : 1))) {
+			goto nomem;
+		}
+		for(i=0; i<count; i++) {
+			ts_init_value(tsv->array + i);
+			tsv->array[i].arena = tsv->arena;
+		}
+		tsv->type = TS_ARRAY;
+		tsv->array_size = count;
+
+		if(count > 0 && rd->depth >= MAX_DEPTH) {
+			fprintf(stderr, "ts_bin_load: arrays nested too deeply\n");
+			return -1;
+		}
+		rd->depth++;
+		for(i=0; i<count; i++) {
+			if(read_value(rd, tsv->array + i) == -1) {
+				rd->depth--;
+				return -1;
+			}
+		}
+		rd->depth--;
+		break;
+
+	default:
+		goto corrupt;
+	}
+	return 0;
+
+nomem:
+	perror("ts_bin_load: failed to allocate value");
+	return -1;
+corrupt:
+	fprintf(stderr, "ts_bin_load: invalid value\n");
+	return -1;
+}
+
+static int check_file_hdr(const unsigned char *hdr)
+{
+	if(!ts_bin_check(hdr, FILE_HDR_SIZE)) {
+		fprintf(stderr, "ts_bin_load: not a treestore binary file\n");
+		return -1;
+	}
+	if(get_u32(hdr + 4) != FILE_VERSION) {
+		fprintf(stderr, "ts_bin_load: unsupported format version: %lu\n",
+				(unsigned long)get_u32(hdr + 4));
+		return -1;
+	}
+	return 0;
+}
+
+/* reads a chunk header, which must be of the expected type */
+static int read_hdr(struct ts_io *io, unsigned char *hdr, uint32_t id, uint32_t *size)
+{
+	if(read_full(io, hdr, CHUNK_HDR_SIZE) < CHUNK_HDR_SIZE) {
+		fprintf(stderr, "ts_bin_load: unexpected end of file\n");
+		return -1;
+	}
+	if(get_u32(hdr) != id) {
+		fprintf(stderr, "ts_bin_load: unexpected chunk %.4s\n", (char*)hdr);
+		return -1;
+	}
+	*size = get_u32(hdr + 4);
+	return 0;
+}
+
+/* ts_io read functions may return less than requested before the end */
+static long read_full(struct ts_io *io, void *buf, long sz)
 {
+	long rd, total = 0;
+
+	while(total < sz) {
+		if((rd = io->read((char*)buf + total, sz - total, io->data)) <= 0) {
+			break;
+		}
+		total += rd;
+	}
+	return total;
+}
+
+#define READ_BLOCK	(1 << 20)
+
+/* reads a chunk of the size given in its header, after presz bytes copied
+ * from pre. The size isn't trusted: the buffer grows as the data actually
+ * arrives, so a bogus header can't make us allocate much more than the input.
+ */
+static unsigned char *read_chunk(struct ts_io *io, const unsigned char *pre, int presz,
+		uint32_t size, long *lenp)
+{
+	unsigned char *buf, *tmp;
+	unsigned long total, cap, len;
+	long rd;
+
+	if((unsigned long)size > (unsigned long)LONG_MAX - presz ||
+			(size_t)size > (size_t)-1 - presz) {
+		fprintf(stderr, "ts_bin_load: chunk too large\n");
+		return 0;
+	}
+	total = (unsigned long)size + presz;
+
+	cap = total < READ_BLOCK ? total : READ_BLOCK;
+	if(!(buf = malloc(cap ? cap : 1))) {
+		perror("ts_bin_load: failed to allocate input buffer");
+		return 0;
+	}
+	if(presz) {
+		memcpy(buf, pre, presz);
+	}
+	len = presz;
+
+	while(len < total) {
+		if(len >= cap) {
+			cap = cap > total / 2 ? total : cap * 2;
+			if(!(tmp = realloc(buf, cap))) {
+				perror("ts_bin_load: failed to allocate input buffer");
+				free(buf);
+				return 0;
+			}
+			buf = tmp;
+		}
+		if((rd = io->read(buf + len, cap - len, io->data)) <= 0) {
+			fprintf(stderr, "ts_bin_load: unexpected end of file\n");
+			free(buf);
+			return 0;
+		}
+		len += rd;
+	}
+	*lenp = len;
+	return buf;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+		((uint32_t)p[3] << 24);
+}
+
+
+/* builds the tree of chunks to write, which can't be nested deeper than the
+ * loader accepts (see MAX_DEPTH)
+ */
+static struct fnode *mkftree(struct ts_node *tree, struct string_table *strtab, int depth)
+{
+	int i;
+	long sz;
 	struct fnode *fnode, *fsub;
 	struct ts_node *sub;
-
-	if(!tree) return 0;
+	struct ts_attr *attr;
 
 	if(!(fnode = calloc(1, sizeof *fnode))) {
 		return 0;
 	}
-	fnode->nameid = stratom(strtab, tree->name);
 	fnode->tsnode = tree;
+	if((fnode->nameid = stratom(strtab, tree->name ? tree->name : "")) == -1) {
+		goto err;
+	}
+
+	/* saving a lazily loaded node which fails to parse would write it empty */
+	if(ts_expand_node(tree) == -1) {
+		fprintf(stderr, "ts_bin_save: failed to expand node \"%s\"\n", tree->name ? tree->name : "");
+		goto err;
+	}
 
+	attr = tree->attr_list;
+	while(attr) {
+		fnode->attr_count++;
+		attr = attr->next;
+	}
+	if(fnode->attr_count && !(fnode->attr_nameid = malloc(fnode->attr_count * sizeof *fnode->attr_nameid))) {
+		goto err;
+	}
+
+	i = 0;
+	attr = tree->attr_list;
+	while(attr) {
+		if((fnode->attr_nameid[i++] = stratom(strtab, attr->name ? attr->name : "")) == -1) {
+			goto err;
+		}
+		if((sz = value_size(&attr->val, strtab, depth)) == -1) {
+			goto err;
+		}
+		fnode->attr_size += 4 + sz;
+		attr = attr->next;
+	}
+	fnode->size = NODE_HDR_SIZE + fnode->attr_size;
+
+	if(tree->child_list && depth >= MAX_DEPTH) {
+		fprintf(stderr, "ts_bin_save: nodes nested too deeply\n");
+		goto err;
+	}
 	sub = tree->child_list;
 	while(sub) {
-		if((fsub = mkftree(sub, strtab))) {
-			if(fnode->chead) {
-				fnode->ctail->next = fsub;
-				fnode->ctail = fsub;
-			} else {
-				fnode->chead = fnode->ctail = fsub;
-			}
+		if(!(fsub = mkftree(sub, strtab, depth + 1))) {
+			goto err;
+		}
+		if(fnode->chead) {
+			fnode->ctail->next = fsub;
+			fnode->ctail = fsub;
+		} else {
+			fnode->chead = fnode->ctail = fsub;
 		}
+		fnode->child_count++;
+		fnode->size += CHUNK_HDR_SIZE + fsub->size;
 		sub = sub->next;
 	}
 
+	if((unsigned long)fnode->size > MAX_CHUNK_SIZE) {
+		fprintf(stderr, "ts_bin_save: node \"%s\" too large\n", tree->name ? tree->name : "");
+		goto err;
+	}
 	return fnode;
+
+err:
+	free_ftree(fnode);
+	return 0;
 }
 
-static int init_strtab(struct string_table *strtab)
+static void free_ftree(struct fnode *fnode)
 {
-	if(!(strtab->str = ts_dynarr_alloc(0, sizeof *strtab->str))) {
+	struct fnode *fsub;
+
+	if(!fnode) return;
+
+	while(fnode->chead) {
+		fsub = fnode->chead;
+		fnode->chead = fsub->next;
+		free_ftree(fsub);
+	}
+	free(fnode->attr_nameid);
+	free(fnode);
+}
+
+/* also adds short string values to the string table */
+static long value_size(struct ts_value *val, struct string_table *strtab, int depth)
+{
+	int i;
+	long sz, len;
+
+	switch(val->type) {
+	case TS_NUMBER:
+		return 5;
+
+	case TS_VECTOR:
+		return 5 + val->vec_size * 4;
+
+	case TS_ARRAY:
+		if(val->array_size > 0 && depth >= MAX_DEPTH) {
+			fprintf(stderr, "ts_bin_save: arrays nested too deeply\n");
+			return -1;
+		}
+		sz = 5;
+		for(i=0; i<val->array_size; i++) {
+			if((len = value_size(val->array + i, strtab, depth + 1)) == -1) {
+				return -1;
+			}
+			sz += len;
+		}
+		return sz;
+
+	default:
+		break;
+	}
+	len = val->str ? strlen(val->str) : 0;
+	if(len < STRREF_MAX_LEN) {
+		return stratom(strtab, val->str ? val->str : "") == -1 ? -1 : 5;
+	}
+	return 5 + len;
+}
+
+static int write_node(struct writer *wr, struct fnode *fnode)
+{
+	int i;
+	struct ts_attr *attr;
+	struct fnode *fsub;
+
+	if(wr_u32(wr, ID_NODE) == -1 || wr_u32(wr, fnode->size) == -1 ||
+			wr_u32(wr, fnode->nameid) == -1 || wr_u32(wr, fnode->attr_count) == -1 ||
+			wr_u32(wr, fnode->child_count) == -1) {
 		return -1;
 	}
+
+	i = 0;
+	attr = fnode->tsnode->attr_list;
+	while(attr) {
+		if(wr_u32(wr, fnode->attr_nameid[i++]) == -1 || write_value(wr, &attr->val) == -1) {
+			return -1;
+		}
+		attr = attr->next;
+	}
+
+	fsub = fnode->chead;
+	while(fsub) {
+		if(write_node(wr, fsub) == -1) {
+			return -1;
+		}
+		fsub = fsub->next;
+	}
 	return 0;
 }
 
-static void destroy_strtab(struct string_table *strtab)
+static int write_value(struct writer *wr, struct ts_value *val)
 {
-	int i, count = ts_dynarr_size(strtab->str);
+	int i;
+	long len;
 
-	for(i=0; i<count; i++) {
-		free(strtab->str[i]);
+	switch(val->type) {
+	case TS_NUMBER:
+		if(ts_value_is_int(val)) {
+			if(wr_u8(wr, BVAL_INT) == -1) return -1;
+			return wr_u32(wr, (uint32_t)val->inum);
+		}
+		if(wr_u8(wr, BVAL_FLOAT) == -1) return -1;
+		return wr_f32(wr, val->fnum);
+
+	case TS_VECTOR:
+		if(wr_u8(wr, BVAL_VEC) == -1 || wr_u32(wr, val->vec_size) == -1) {
+			return -1;
+		}
+		if(little_endian()) {
+			return wr_bytes(wr, val->vec, val->vec_size * 4);
+		}
+		for(i=0; i<val->vec_size; i++) {
+			if(wr_f32(wr, val->vec[i]) == -1) return -1;
+		}
+		return 0;
+
+	case TS_ARRAY:
+		if(wr_u8(wr, BVAL_ARR) == -1 || wr_u32(wr, val->array_size) == -1) {
+			return -1;
+		}
+		for(i=0; i<val->array_size; i++) {
+			if(write_value(wr, val->array + i) == -1) return -1;
+		}
+		return 0;
+
+	default:
+		break;
+	}
+
+	len = val->str ? strlen(val->str) : 0;
+	if(len < STRREF_MAX_LEN) {
+		/* already in the string table, so this just finds it */
+		if(wr_u8(wr, BVAL_STRREF) == -1 ||
+				wr_u32(wr, stratom(wr->strtab, val->str ? val->str : "")) == -1) {
+			return -1;
+		}
+		return 0;
+	}
+	if(wr_u8(wr, BVAL_STR) == -1 || wr_u32(wr, len) == -1) {
+		return -1;
+	}
+	return wr_bytes(wr, val->str, len);
+}
+
+static int wr_flush(struct writer *wr)
+{
+	if(wr->len > 0 && wr->io->write(wr->buf, wr->len, wr->io->data) < wr->len) {
+		fprintf(stderr, "ts_bin_save: failed to write %ld bytes\n", wr->len);
+		return -1;
+	}
+	wr->len = 0;
+	return 0;
+}
+
+static int wr_bytes(struct writer *wr, const void *data, long sz)
+{
+	if(wr->len + sz > WRBUF_SIZE) {
+		if(wr_flush(wr) == -1) {
+			return -1;
+		}
+		if(sz > WRBUF_SIZE) {
+			/* large blocks go straight through */
+			if(wr->io->write(data, sz, wr->io->data) < sz) {
+				fprintf(stderr, "ts_bin_save: failed to write %ld bytes\n", sz);
+				return -1;
+			}
+			return 0;
+		}
+	}
+	memcpy(wr->buf + wr->len, data, sz);
+	wr->len += sz;
+	return 0;
+}
+
+static int wr_u8(struct writer *wr, unsigned int x)
+{
+	unsigned char b = x;
+	return wr_bytes(wr, &b, 1);
+}
+
+static int wr_u32(struct writer *wr, uint32_t x)
+{
+	unsigned char b[4];
+
+	b[0] = x & 0xff;
+	b[1] = (x >> 8) & 0xff;
+	b[2] = (x >> 16) & 0xff;
+	b[3] = x >> 24;
+	return wr_bytes(wr, b, 4);
+}
+
+static int wr_f32(struct writer *wr, float x)
+{
+	union { float f; uint32_t u; } u;
+	u.f = x;
+	return wr_u32(wr, u.u);
+}
+
+static int little_endian(void)
+{
+	uint32_t x = 1;
+	return *(unsigned char*)&x == 1;
+}
+
+#define STRTAB_MIN_SLOTS	64
+
+static int init_strtab(struct string_table *strtab)
+{
+	if(!(strtab->str = ts_dynarr_alloc(0, sizeof *strtab->str))) {
+		return -1;
 	}
+	strtab->size = 0;
+
+	if(!(strtab->slot = calloc(STRTAB_MIN_SLOTS, sizeof *strtab->slot))) {
+		ts_dynarr_free(strtab->str);
+		return -1;
+	}
+	strtab->nslots = STRTAB_MIN_SLOTS;
+	return 0;
+}
 
+static void destroy_strtab(struct string_table *strtab)
+{
 	ts_dynarr_free(strtab->str);
+	free(strtab->slot);
 }
 
+/* returns the index of name in the string table, adding it if necessary */
 static int stratom(struct string_table *strtab, const char *name)
 {
-	int i, count = ts_dynarr_size(strtab->str);
-	char *str;
-	char **tmptab;
+	int count = ts_dynarr_size(strtab->str);
+	unsigned int i, hash, mask;
+	long len;
+	struct strtab_slot *slot;
+	void *tmp;
 
-	for(i=0; i<count; i++) {
-		if(strcmp(strtab->str[i], name) == 0) {
-			return i;
+	len = strlen(name);
+	hash = ts_intern_hash(name, len);
+
+	mask = strtab->nslots - 1;
+	i = hash & mask;
+	while((slot = strtab->slot + i)->idx) {
+		if(slot->hash == hash && strcmp(strtab->str[slot->idx - 1], name) == 0) {
+			return slot->idx - 1;
 		}
+		i = (i + 1) & mask;
 	}
 
-	if(!(str = strdup(name)) || !(tmptab = ts_dynarr_push(strtab->str, &str))) {
-		fprintf(stderr, "ts_bin_save: failed to resize string table\n");
-		free(str);
-		return -1;
+	if(count + 1 > strtab->nslots / 2) {
+		if(grow_strtab(strtab) == -1) {
+			goto err;
+		}
+		mask = strtab->nslots - 1;
+		i = hash & mask;
+		while(strtab->slot[i].idx) {
+			i = (i + 1) & mask;
+		}
+		slot = strtab->slot + i;
+	}
+
+	tmp = ts_dynarr_push(strtab->str, &name);
+	if(ts_dynarr_size(tmp) <= count) {
+		goto err;
 	}
-	strtab->str = tmptab;
+	strtab->str = tmp;
+	strtab->size += len + 1;
+
+	slot->hash = hash;
+	slot->idx = count + 1;
 	return count;
+
+err:
+	fprintf(stderr, "ts_bin_save: failed to resize string table\n");
+	return -1;
+}
+
+static int grow_strtab(struct string_table *strtab)
+{
+	int i, newsz = strtab->nslots * 2;
+	unsigned int j, mask = newsz - 1;
+	struct strtab_slot *slot;
+
+	if(!(slot = calloc(newsz, sizeof *slot))) {
+		return -1;
+	}
+	for(i=0; i<strtab->nslots; i++) {
+		if(!strtab->slot[i].idx) continue;
+
+		j = strtab->slot[i].hash & mask;
+		while(slot[j].idx) {
+			j = (j + 1) & mask;
+		}
+		slot[j] = strtab->slot[i];
+	}
+	free(strtab->slot);
+	strtab->slot = slot;
+	strtab->nslots = newsz;
+	return 0;
 }
@@ -131,3 +131,69 @@ void *ts_dynarr_pop(void *da)
 
 	return da;
 }
+
+
+/* ---- string builder ---- */
+
+void ts_strbuf_init(struct ts_strbuf *sb)
+{
+	sb->str = 0;
+	sb->len = sb->cap = 0;
+}
+
+void ts_strbuf_destroy(struct ts_strbuf *sb)
+{
+	free(sb->str);
+	ts_strbuf_init(sb);
+}
+
+int ts_strbuf_reserve(struct ts_strbuf *sb, long sz)
+{
+	char *tmp;
+	long newcap;
+
+	if(sz < sb->cap) return 0;
+
+	newcap = sb->cap ? sb->cap : 32;
+	while(newcap <= sz) newcap *= 2;
+
+	if(!(tmp = realloc(sb->str, newcap))) {
+		return -1;
+	}
+	if(!sb->str) tmp[0] = 0;
+	sb->str = tmp;
+	sb->cap = newcap;
+	return 0;
+}
+
+void ts_strbuf_clear(struct ts_strbuf *sb)
+{
+	sb->len = 0;
+	if(sb->str) sb->str[0] = 0;
+}
+
+int ts_strbuf_append(struct ts_strbuf *sb, const char *s, long len)
+{
+	if(ts_strbuf_reserve(sb, sb->len + len) == -1) {
+		return -1;
+	}
+	memcpy(sb->str + sb->len, s, len);
+	sb->len += len;
+	sb->str[sb->len] = 0;
+	return 0;
+}
+
+int ts_strbuf_appendstr(struct ts_strbuf *sb, const char *s)
+{
+	return ts_strbuf_append(sb, s, strlen(s));
+}
+
+int ts_strbuf_appendc(struct ts_strbuf *sb, int c)
+{
+	if(sb->len + 1 >= sb->cap && ts_strbuf_reserve(sb, sb->len + 1) == -1) {
+		return -1;
+	}
+	sb->str[sb->len++] = c;
+	sb->str[sb->len] = 0;
+	return 0;
+}
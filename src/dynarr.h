@@ -66,4 +66,24 @@ void *ts_dynarr_pop(void *da);
 	} while(0)
 
 
+/* string builder: a grow-only character buffer for assembling strings
+ * piecemeal. The string is kept zero-terminated after every operation, and
+ * clearing it keeps the allocated capacity around for reuse.
+ */
+struct ts_strbuf {
+	char *str;
+	long len, cap;
+};
+
+void ts_strbuf_init(struct ts_strbuf *sb);
+void ts_strbuf_destroy(struct ts_strbuf *sb);
+
+/* make sure there's room for at least sz characters plus the terminator */
+int ts_strbuf_reserve(struct ts_strbuf *sb, long sz);
+void ts_strbuf_clear(struct ts_strbuf *sb);
+
+int ts_strbuf_append(struct ts_strbuf *sb, const char *s, long len);
+int ts_strbuf_appendstr(struct ts_strbuf *sb, const char *s);
+int ts_strbuf_appendc(struct ts_strbuf *sb, int c);
+
 #endif	/* DYNARR_H_ */
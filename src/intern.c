@@ -0,0 +1,249 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "treestor.h"
+#include "intern.h"
+#include "arena.h"
+
+#if (defined(unix) || defined(__unix__) || defined(__APPLE__)) && !defined(TS_NO_THREADS)
+#define USE_THREADS
+#include <pthread.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()		pthread_mutex_lock(&lock)
+#define UNLOCK()	pthread_mutex_unlock(&lock)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+/* Atoms are handed out to callers and cached all over the place (node and
+ * attribute names, compiled paths, queries, parser name caches) without any
+ * reference counting, so entries can never be removed. Instead the table
+ * stops growing at a memory limit, and names which don't fit are left
+ * un-interned (atom 0), with each node or attribute owning a copy.
+ */
+#ifndef TS_INTERN_LIMIT
+#define TS_INTERN_LIMIT	(16L << 20)
+#endif
+
+/* rough cost of an atom besides its string: the names entry, and two hash
+ * table slots since the table is kept at most half full
+ */
+#define ATOM_OVERHEAD	((long)(sizeof(char*) + 2 * sizeof(struct entry)))
+
+/* strings are packed into large blocks, except for unusually long ones */
+#define STRBLOCK_SIZE	65536
+
+/* open-addressing hash table of atoms, with the hash stored alongside */
+struct entry {
+	unsigned int hash;
+	int atom;
+	long len;
+};
+
+static struct entry *table;
+static int tabsize, num_atoms;
+
+static const char **names;	/* interned strings indexed by atom, names[0] unused */
+static int max_names;
+
+static char *strblock;
+static size_t strblock_used;
+
+static long mem_limit = TS_INTERN_LIMIT, mem_used;
+
+static int find_slot(const char *str, long len, unsigned int hash);
+static int grow_table(void);
+static const char *store_str(const char *str, long len);
+
+
+int ts_intern(const char *name)
+{
+	const char *s;
+	long len = strlen(name);
+	return ts_intern_len(name, len, ts_intern_hash(name, len), &s);
+}
+
+void ts_set_intern_limit(long bytes)
+{
+	LOCK();
+	mem_limit = bytes;
+	UNLOCK();
+}
+
+const char *ts_atom_name(int atom)
+{
+	const char *s = 0;
+
+	LOCK();
+	if(atom > 0 && atom <= num_atoms) {
+		s = names[atom];
+	}
+	UNLOCK();
+	return s;
+}
+
+/* FNV-1a */
+unsigned int ts_intern_hash(const char *str, long len)
+{
+	unsigned int hash = 2166136261u;
+	while(len-- > 0) {
+		hash = (hash ^ (unsigned char)*str++) * 16777619u;
+	}
+	return hash;
+}
+
+int ts_intern_len(const char *str, long len, unsigned int hash, const char **strp)
+{
+	int idx, atom = -1;
+	const char *s;
+
+	LOCK();
+
+	if(num_atoms * 2 >= tabsize && grow_table() == -1) {
+		goto end;
+	}
+
+	idx = find_slot(str, len, hash);
+	if(table[idx].atom) {
+		atom = table[idx].atom;
+		*strp = names[atom];
+		goto end;
+	}
+
+	if(mem_limit > 0 && mem_used + len + 1 + ATOM_OVERHEAD > mem_limit) {
+		atom = 0;
+		*strp = 0;
+		goto end;
+	}
+
+	if(num_atoms + 1 >= max_names) {
+		int newmax = max_names ? max_names * 2 : 256;
+		const char **tmp = realloc(names, newmax * sizeof *names);
+		if(!tmp) goto end;
+		names = tmp;
+		max_names = newmax;
+	}
+	if(!(s = store_str(str, len))) {
+		goto end;
+	}
+
+	atom = ++num_atoms;
+	names[atom] = s;
+	table[idx].hash = hash;
+	table[idx].atom = atom;
+	table[idx].len = len;
+	mem_used += len + 1 + ATOM_OVERHEAD;
+	*strp = s;
+
+end:
+	UNLOCK();
+	return atom;
+}
+
+/* returns the slot holding str, or the empty slot where it belongs */
+static int find_slot(const char *str, long len, unsigned int hash)
+{
+	int idx = hash & (tabsize - 1);
+	const char *s;
+
+	while(table[idx].atom) {
+		if(table[idx].hash == hash && table[idx].len == len) {
+			s = names[table[idx].atom];
+			if(memcmp(s, str, len) == 0) {
+				break;
+			}
+		}
+		idx = (idx + 1) & (tabsize - 1);
+	}
+	return idx;
+}
+
+static int grow_table(void)
+{
+	int i, idx, newsz = tabsize ? tabsize * 2 : 512;
+	struct entry *newtab;
+
+	if(!(newtab = calloc(newsz, sizeof *newtab))) {
+		return -1;
+	}
+	for(i=0; i<tabsize; i++) {
+		if(table[i].atom) {
+			idx = table[i].hash & (newsz - 1);
+			while(newtab[idx].atom) {
+				idx = (idx + 1) & (newsz - 1);
+			}
+			newtab[idx] = table[i];
+		}
+	}
+	free(table);
+	table = newtab;
+	tabsize = newsz;
+	return 0;
+}
+
+static const char *store_str(const char *str, long len)
+{
+	char *s;
+
+	if(len >= STRBLOCK_SIZE / 8) {
+		if(!(s = malloc(len + 1))) {
+			return 0;
+		}
+	} else {
+		if(!strblock || strblock_used + len + 1 > STRBLOCK_SIZE) {
+			if(!(strblock = malloc(STRBLOCK_SIZE))) {
+				return 0;
+			}
+			strblock_used = 0;
+		}
+		s = strblock + strblock_used;
+		strblock_used += len + 1;
+	}
+	memcpy(s, str, len);
+	s[len] = 0;
+	return s;
+}
+
+char *ts_name_copy(struct ts_arena *arena, const char *str, long len)
+{
+	char *s;
+
+	if(arena) {
+		s = ts_arena_alloc(arena, len + 1);
+	} else {
+		s = malloc(len + 1);
+	}
+	if(!s) return 0;
+
+	memcpy(s, str, len);
+	s[len] = 0;
+	return s;
+}
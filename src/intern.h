@@ -0,0 +1,50 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+#ifndef TS_INTERN_H_
+#define TS_INTERN_H_
+
+struct ts_arena;
+
+/* global table of interned node and attribute names. Atoms are positive, so
+ * 0 can be used to mean "not interned", and interned strings are never freed.
+ */
+unsigned int ts_intern_hash(const char *str, long len);
+
+/* returns the atom for str, interning it if necessary, or -1 on failure. The
+ * interned string is returned through strp. If str isn't interned yet and the
+ * table is at its limit (see ts_set_intern_limit), returns 0 and sets *strp to
+ * null; the name must then be copied with ts_name_copy. Thread-safe.
+ */
+int ts_intern_len(const char *str, long len, unsigned int hash, const char **strp);
+
+/* copies a name which isn't interned, for a node or attribute with name_atom 0
+ * to own. It's allocated from the arena if there is one, otherwise it's freed
+ * by ts_destroy_node/ts_destroy_attr.
+ */
+char *ts_name_copy(struct ts_arena *arena, const char *str, long len);
+
+#endif	/* TS_INTERN_H_ */
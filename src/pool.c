@@ -0,0 +1,354 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+#include <stdlib.h>
+#include "treestor.h"
+#include "pool.h"
+
+#if (defined(unix) || defined(__unix__) || defined(__APPLE__)) && !defined(TS_NO_THREADS)
+#define USE_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(USE_THREADS) && defined(__GNUC__)
+#define USE_TLCACHE
+#endif
+
+#define SLAB_SIZE		32768
+#define TLCACHE_MAX		64		/* flush half of the thread cache when it gets this big */
+
+struct slab {
+	struct slab *next;
+	double pad;		/* keep the objects following the header aligned */
+};
+
+struct freeobj {
+	struct freeobj *next;
+};
+
+struct pool {
+	size_t objsize;
+	int perslab;
+
+	struct slab *slabs;
+	struct freeobj *freelist;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+#define OBJSIZE(x)	((sizeof(x) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+#ifdef USE_THREADS
+#define POOL_INIT(type)	{OBJSIZE(type), (SLAB_SIZE - sizeof(struct slab)) / OBJSIZE(type), 0, 0, PTHREAD_MUTEX_INITIALIZER}
+#define LOCK(p)		pthread_mutex_lock(&(p)->lock)
+#define UNLOCK(p)	pthread_mutex_unlock(&(p)->lock)
+#else
+#define POOL_INIT(type)	{OBJSIZE(type), (SLAB_SIZE - sizeof(struct slab)) / OBJSIZE(type), 0, 0}
+#define LOCK(p)
+#define UNLOCK(p)
+#endif
+
+static struct pool pools[TS_NUM_POOLS] = {
+	POOL_INIT(struct ts_node),
+	POOL_INIT(struct ts_attr),
+	POOL_INIT(struct ts_value)
+};
+
+#ifndef TS_NO_POOLS
+
+#ifdef USE_TLCACHE
+struct tlcache {
+	struct freeobj *head;
+	int count;
+};
+static __thread struct tlcache tlcache[TS_NUM_POOLS];
+
+/* the caches of exiting threads are returned to the pools by the destructor
+ * of this key, which gets a value the first time a thread uses its cache,
+ * whether to allocate or to free
+ */
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+static __thread int exit_registered;
+
+static void register_exit(void);
+static void refill_cache(struct pool *p, struct tlcache *tc);
+static void flush_cache(struct pool *p, struct tlcache *tc, int count);
+#endif
+
+static void *take_obj(struct pool *p);
+static void trim_pool(struct pool *p);
+
+
+void *ts_pool_alloc(int pidx)
+{
+	struct pool *p = pools + pidx;
+	struct freeobj *obj;
+#ifdef USE_TLCACHE
+	struct tlcache *tc = tlcache + pidx;
+
+	if(!tc->head) {
+		refill_cache(p, tc);
+		if(!tc->head) return 0;
+	}
+	obj = tc->head;
+	tc->head = obj->next;
+	tc->count--;
+#else
+	LOCK(p);
+	obj = take_obj(p);
+	UNLOCK(p);
+#endif
+	return obj;
+}
+
+void ts_pool_free(int pidx, void *ptr)
+{
+	struct pool *p = pools + pidx;
+	struct freeobj *obj = ptr;
+#ifdef USE_TLCACHE
+	struct tlcache *tc = tlcache + pidx;
+
+	if(!exit_registered) {
+		register_exit();
+	}
+	obj->next = tc->head;
+	tc->head = obj;
+	if(++tc->count >= TLCACHE_MAX) {
+		flush_cache(p, tc, TLCACHE_MAX / 2);
+	}
+#else
+	LOCK(p);
+	obj->next = p->freelist;
+	p->freelist = obj;
+	UNLOCK(p);
+#endif
+}
+
+/* the other threads' caches are accessed without locking by their owners, so
+ * only the calling thread's cache can be flushed here
+ */
+void ts_trim_pools(void)
+{
+	int i;
+	struct pool *p;
+
+	for(i=0; i<TS_NUM_POOLS; i++) {
+		p = pools + i;
+#ifdef USE_TLCACHE
+		flush_cache(p, tlcache + i, tlcache[i].count);
+#endif
+		LOCK(p);
+		trim_pool(p);
+		UNLOCK(p);
+	}
+}
+
+#ifdef USE_TLCACHE
+static void thread_exit(void *arg)
+{
+	int i;
+	(void)arg;	/* same as tlcache, which is still valid in the exiting thread */
+	for(i=0; i<TS_NUM_POOLS; i++) {
+		flush_cache(pools + i, tlcache + i, tlcache[i].count);
+	}
+}
+
+static void create_exit_key(void)
+{
+	pthread_key_create(&exit_key, thread_exit);
+}
+
+static void register_exit(void)
+{
+	pthread_once(&exit_key_once, create_exit_key);
+	pthread_setspecific(exit_key, tlcache);
+	exit_registered = 1;
+}
+
+static void refill_cache(struct pool *p, struct tlcache *tc)
+{
+	struct freeobj *obj;
+
+	if(!exit_registered) {
+		register_exit();
+	}
+
+	LOCK(p);
+	while(tc->count < TLCACHE_MAX / 2 && (obj = take_obj(p))) {
+		obj->next = tc->head;
+		tc->head = obj;
+		tc->count++;
+	}
+	UNLOCK(p);
+}
+
+/* return count objects from the thread cache to the pool */
+static void flush_cache(struct pool *p, struct tlcache *tc, int count)
+{
+	struct freeobj *obj;
+
+	LOCK(p);
+	while(count-- > 0 && (obj = tc->head)) {
+		tc->head = obj->next;
+		tc->count--;
+		obj->next = p->freelist;
+		p->freelist = obj;
+	}
+	UNLOCK(p);
+}
+#endif
+
+/* called with the pool locked */
+static void *take_obj(struct pool *p)
+{
+	int i;
+	char *ptr;
+	struct slab *slab;
+	struct freeobj *obj;
+
+	if(!p->freelist) {
+		if(!(slab = malloc(SLAB_SIZE))) {
+			return 0;
+		}
+		slab->next = p->slabs;
+		p->slabs = slab;
+
+		ptr = (char*)(slab + 1) + (p->perslab - 1) * p->objsize;
+		for(i=0; i<p->perslab; i++) {
+			obj = (struct freeobj*)ptr;
+			obj->next = p->freelist;
+			p->freelist = obj;
+			ptr -= p->objsize;
+		}
+	}
+
+	obj = p->freelist;
+	p->freelist = obj->next;
+	return obj;
+}
+
+static int cmp_slab_addr(const void *a, const void *b)
+{
+	const char *sa = *(const char**)a;
+	const char *sb = *(const char**)b;
+	return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+static int find_slab(struct slab **slabs, int nslabs, void *obj)
+{
+	int mid, lo = 0, hi = nslabs - 1;
+
+	while(lo <= hi) {
+		mid = (lo + hi) / 2;
+		if((char*)obj < (char*)slabs[mid]) {
+			hi = mid - 1;
+		} else if((char*)obj >= (char*)slabs[mid] + SLAB_SIZE) {
+			lo = mid + 1;
+		} else {
+			return mid;
+		}
+	}
+	return -1;
+}
+
+/* free the slabs which have all their objects in the free list. Called with
+ * the pool locked.
+ */
+static void trim_pool(struct pool *p)
+{
+	int i, idx, nslabs = 0;
+	struct slab *slab, **slabs;
+	struct freeobj *obj, *next;
+	int *nfree;
+
+	for(slab = p->slabs; slab; slab = slab->next) {
+		nslabs++;
+	}
+	if(!nslabs) return;
+
+	if(!(slabs = malloc(nslabs * sizeof *slabs))) {
+		return;
+	}
+	if(!(nfree = calloc(nslabs, sizeof *nfree))) {
+		free(slabs);
+		return;
+	}
+	i = 0;
+	for(slab = p->slabs; slab; slab = slab->next) {
+		slabs[i++] = slab;
+	}
+	qsort(slabs, nslabs, sizeof *slabs, cmp_slab_addr);
+
+	for(obj = p->freelist; obj; obj = obj->next) {
+		if((idx = find_slab(slabs, nslabs, obj)) >= 0) {
+			nfree[idx]++;
+		}
+	}
+
+	/* drop the objects of entirely free slabs from the free list */
+	obj = p->freelist;
+	p->freelist = 0;
+	while(obj) {
+		next = obj->next;
+		if((idx = find_slab(slabs, nslabs, obj)) < 0 || nfree[idx] < p->perslab) {
+			obj->next = p->freelist;
+			p->freelist = obj;
+		}
+		obj = next;
+	}
+
+	p->slabs = 0;
+	for(i=0; i<nslabs; i++) {
+		if(nfree[i] >= p->perslab) {
+			free(slabs[i]);
+		} else {
+			slabs[i]->next = p->slabs;
+			p->slabs = slabs[i];
+		}
+	}
+
+	free(nfree);
+	free(slabs);
+}
+
+#else	/* TS_NO_POOLS */
+
+void *ts_pool_alloc(int pidx)
+{
+	return malloc(pools[pidx].objsize);
+}
+
+void ts_pool_free(int pidx, void *ptr)
+{
+	free(ptr);
+}
+
+void ts_trim_pools(void)
+{
+}
+#endif	/* TS_NO_POOLS */
@@ -0,0 +1,390 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "treestor.h"
+#include "intern.h"
+
+int ts_parse_num(const char *s, const char *end, double *num, int *inum, int *isint);
+
+/* A query is matched like a regular expression over the path from the root to
+ * each node, by simulating its NFA during a depth-first walk: every node gets
+ * the set of states it leaves the query in, as a bitmask where bit i means
+ * segment i is next to be matched, and bit nseg that the whole query matched.
+ * Subtrees are skipped as soon as the set becomes empty, and since each node
+ * is visited once, no match can be reported twice.
+ */
+
+enum { QS_NAME, QS_ANY, QS_DESC };
+
+#define MAX_SEGS	((int)sizeof(unsigned long) * 8 - 1)
+#define BIT(i)		(1UL << (i))
+
+struct query_seg {
+	int type;
+	const char *name;	/* for QS_NAME segments, interned or namebuf */
+	int atom;			/* 0 if the intern table is full */
+	char *namebuf;
+
+	/* optional predicate: [attr] or [attr=value] */
+	char *pname;	/* attribute name, null if there's no predicate */
+	int pattr;		/* its atom, or 0 if it isn't interned */
+	char *pval;		/* value to compare with, or null */
+	float pnum;
+	int pval_isnum;
+};
+
+/* the walk keeps a stack of children lists being iterated */
+struct query_frame {
+	struct ts_node *next;	/* next child to try */
+	unsigned long states;	/* states of their parent */
+	int chain;				/* iterating only the children with one name */
+};
+
+struct ts_query {
+	int nseg;
+	struct query_seg *seg;
+
+	struct ts_node *root;
+	int root_pending;
+
+	struct query_frame *stack;
+	int top, max_stack;
+};
+
+static int parse_seg(struct query_seg *seg, const char *s, const char *end);
+static unsigned long closure(struct ts_query *q, unsigned long states);
+static unsigned long step(struct ts_query *q, unsigned long states, struct ts_node *node);
+static int push(struct ts_query *q, struct ts_node *node, unsigned long states);
+
+
+struct ts_query *ts_query(struct ts_node *root, const char *query)
+{
+	int i, depth = 0;
+	const char *p, *start;
+	struct ts_query *q;
+
+	if(!(q = calloc(1, sizeof *q))) {
+		return 0;
+	}
+
+	/* count the dots which aren't inside predicates */
+	q->nseg = 1;
+	for(p=query; *p; p++) {
+		if(*p == '[') depth++;
+		if(*p == ']') depth--;
+		if(*p == '.' && !depth) q->nseg++;
+	}
+	if(q->nseg > MAX_SEGS) {
+		fprintf(stderr, "ts_query: too many segments: %s\n", query);
+		goto err;
+	}
+	if(!(q->seg = calloc(q->nseg, sizeof *q->seg))) {
+		goto err;
+	}
+
+	p = start = query;
+	depth = 0;
+	for(i=0; i<q->nseg; i++) {
+		while(*p && (*p != '.' || depth)) {
+			if(*p == '[') depth++;
+			if(*p == ']') depth--;
+			p++;
+		}
+		if(parse_seg(q->seg + i, start, p) == -1) {
+			fprintf(stderr, "ts_query: invalid query: %s\n", query);
+			goto err;
+		}
+		start = ++p;
+	}
+
+	ts_query_reset(q, root);
+	return q;
+
+err:
+	ts_query_free(q);
+	return 0;
+}
+
+void ts_query_free(struct ts_query *q)
+{
+	int i;
+
+	if(!q) return;
+
+	if(q->seg) {
+		for(i=0; i<q->nseg; i++) {
+			free(q->seg[i].namebuf);
+			free(q->seg[i].pname);
+			free(q->seg[i].pval);
+		}
+		free(q->seg);
+	}
+	free(q->stack);
+	free(q);
+}
+
+void ts_query_reset(struct ts_query *q, struct ts_node *root)
+{
+	q->root = root;
+	q->root_pending = root != 0;
+	q->top = 0;
+}
+
+struct ts_node *ts_query_next(struct ts_query *q)
+{
+	struct query_frame *frm;
+	struct ts_node *node;
+	unsigned long states;
+
+	if(q->root_pending) {
+		q->root_pending = 0;
+		node = q->root;
+		if((states = step(q, closure(q, BIT(0)), node))) {
+			if(push(q, node, states) == -1) {
+				return 0;
+			}
+			if(states & BIT(q->nseg)) {
+				return node;
+			}
+		}
+	}
+
+	while(q->top > 0) {
+		frm = q->stack + q->top - 1;
+		if(!(node = frm->next)) {
+			q->top--;
+			continue;
+		}
+		frm->next = frm->chain ? ts_get_next_child(node) : node->next;
+
+		if(!(states = step(q, frm->states, node))) {
+			continue;
+		}
+		if(push(q, node, states) == -1) {
+			q->top = 0;
+			return 0;
+		}
+		if(states & BIT(q->nseg)) {
+			return node;
+		}
+	}
+	return 0;
+}
+
+/* segments are names, * or **, and names or * can be followed by a predicate */
+static int parse_seg(struct query_seg *seg, const char *s, const char *end)
+{
+	const char *pred, *eq, *vstart, *vend;
+	double num;
+	int inum, isint;
+	long len;
+
+	if(!(pred = memchr(s, '[', end - s))) {
+		pred = end;
+	}
+	len = pred - s;
+
+	if(len == 2 && memcmp(s, "**", 2) == 0) {
+		seg->type = QS_DESC;
+		return pred == end ? 0 : -1;
+	}
+	if(len == 1 && *s == '*') {
+		seg->type = QS_ANY;
+	} else {
+		if(len <= 0) return -1;
+		seg->type = QS_NAME;
+		if((seg->atom = ts_intern_len(s, len, ts_intern_hash(s, len), &seg->name)) == -1) {
+			return -1;
+		}
+		if(!seg->atom) {
+			if(!(seg->namebuf = ts_name_copy(0, s, len))) {
+				return -1;
+			}
+			seg->name = seg->namebuf;
+		}
+	}
+
+	if(pred == end) {
+		return 0;
+	}
+	if(end[-1] != ']' || end - pred < 3) {
+		return -1;
+	}
+	pred++;
+	end--;
+
+	if(!(eq = memchr(pred, '=', end - pred))) {
+		eq = end;
+	}
+	len = eq - pred;
+	if(len <= 0 || !(seg->pname = ts_name_copy(0, pred, len))) {
+		return -1;
+	}
+	if((seg->pattr = ts_intern_len(pred, len, ts_intern_hash(pred, len), &vstart)) == -1) {
+		return -1;
+	}
+	if(eq == end) {
+		return 0;
+	}
+
+	vstart = eq + 1;
+	vend = end;
+	if(vend - vstart >= 2 && *vstart == '"' && vend[-1] == '"') {
+		vstart++;
+		vend--;
+	}
+	len = vend - vstart;
+	if(!(seg->pval = malloc(len + 1))) {
+		return -1;
+	}
+	memcpy(seg->pval, vstart, len);
+	seg->pval[len] = 0;
+
+	/* parsed like numbers in the text format, regardless of the locale */
+	if(ts_parse_num(seg->pval, seg->pval + len, &num, &inum, &isint) == 0) {
+		seg->pnum = isint ? (float)inum : (float)num;
+		seg->pval_isnum = 1;
+	}
+	return 0;
+}
+
+/* ** also matches nothing, so the segment after it is live too */
+static unsigned long closure(struct ts_query *q, unsigned long states)
+{
+	int i;
+
+	for(i=0; i<q->nseg; i++) {
+		if((states & BIT(i)) && q->seg[i].type == QS_DESC) {
+			states |= BIT(i + 1);
+		}
+	}
+	return states;
+}
+
+static int match_name(struct query_seg *seg, struct ts_node *node)
+{
+	if(node->name_atom) {
+		return node->name_atom == seg->atom;
+	}
+	return node->name && strcmp(node->name, seg->name) == 0;
+}
+
+static int match_pred(struct query_seg *seg, struct ts_node *node)
+{
+	struct ts_attr *attr;
+	const char *str;
+
+	if(!seg->pname) return 1;
+
+	if(!(attr = seg->pattr ? ts_get_attr_atom(node, seg->pattr) : ts_get_attr(node, seg->pname))) {
+		return 0;
+	}
+	if(!seg->pval) return 1;
+
+	if(attr->val.type == TS_NUMBER && seg->pval_isnum) {
+		return attr->val.fnum == seg->pnum;
+	}
+	return (str = ts_get_value_str(&attr->val)) && strcmp(str, seg->pval) == 0;
+}
+
+/* the states a node leaves the query in, given the states of its parent */
+static unsigned long step(struct ts_query *q, unsigned long states, struct ts_node *node)
+{
+	int i;
+	unsigned long res = 0;
+	struct query_seg *seg;
+
+	for(i=0; i<q->nseg; i++) {
+		if(!(states & BIT(i))) continue;
+
+		seg = q->seg + i;
+		switch(seg->type) {
+		case QS_DESC:
+			res |= BIT(i);	/* absorb the node */
+			break;
+
+		case QS_NAME:
+			if(!match_name(seg, node)) break;
+			/* fallthrough */
+		case QS_ANY:
+			if(match_pred(seg, node)) {
+				res |= BIT(i + 1);
+			}
+			break;
+		}
+	}
+	return closure(q, res);
+}
+
+/* start iterating the children of node, if any of them can match */
+static int push(struct ts_query *q, struct ts_node *node, unsigned long states)
+{
+	int i;
+	struct query_frame *frm;
+	struct query_seg *single = 0;
+
+	if(!(states & (BIT(q->nseg) - 1))) {
+		return 0;	/* nothing left to match below this node */
+	}
+
+	if(q->top >= q->max_stack) {
+		int newsz = q->max_stack ? q->max_stack * 2 : 16;
+		void *tmp = realloc(q->stack, newsz * sizeof *q->stack);
+		if(!tmp) return -1;
+		q->stack = tmp;
+		q->max_stack = newsz;
+	}
+	frm = q->stack + q->top;
+	frm->states = states;
+
+	/* if the only thing that can match next is a single name, iterate just
+	 * the children with that name, which uses the child index if there is one
+	 */
+	for(i=0; i<q->nseg; i++) {
+		if(!(states & BIT(i))) continue;
+		if(q->seg[i].type != QS_NAME || (single && (single->atom != q->seg[i].atom ||
+				(!single->atom && strcmp(single->name, q->seg[i].name) != 0)))) {
+			single = 0;
+			break;
+		}
+		single = q->seg + i;
+	}
+
+	if(single) {
+		frm->next = ts_get_child(node, single->name);
+		frm->chain = 1;
+	} else {
+		frm->next = ts_get_child_list(node);
+		frm->chain = 0;
+	}
+	if(frm->next) {
+		q->top++;
+	}
+	return 0;
+}
@@ -0,0 +1,380 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+#include "scan.h"
+
+#if !defined(TS_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2
+#include <immintrin.h>
+#ifdef __SSE2__
+#define USE_SSE2
+#endif
+#endif
+
+static long space_init(const char *p, const char *end, int *nlines);
+static long eol_init(const char *p, const char *end);
+static long id_init(const char *p, const char *end);
+static long str_init(const char *p, const char *end, int *nlines);
+static long struct_init(const char *p, const char *end, int *nlines);
+
+/* start out pointing to the init functions, which select an implementation
+ * the first time any of them is called
+ */
+long (*ts_scan_space)(const char*, const char*, int*) = space_init;
+long (*ts_scan_eol)(const char*, const char*) = eol_init;
+long (*ts_scan_id)(const char*, const char*) = id_init;
+long (*ts_scan_str)(const char*, const char*, int*) = str_init;
+long (*ts_scan_struct)(const char*, const char*, int*) = struct_init;
+
+
+/* ---- scalar implementations ---- */
+#define IS_SPACE(c)	((c) == ' ' || (unsigned char)((c) - 9) <= 4)
+#define IS_STRUCT(c)	((c) == '{' || (c) == '}' || (c) == '"' || (c) == '#')
+#define IS_ID(c) \
+	((unsigned char)(((c) | 0x20) - 'a') <= 25 || (unsigned char)((c) - '0') <= 9 || (c) == '_')
+
+static long space_scalar(const char *p, const char *end, int *nlines)
+{
+	const char *start = p;
+	while(p < end && IS_SPACE(*p)) {
+		if(*p++ == '\n') ++*nlines;
+	}
+	return p - start;
+}
+
+static long eol_scalar(const char *p, const char *end)
+{
+	const char *start = p;
+	while(p < end && *p != '\n') p++;
+	return p - start;
+}
+
+static long id_scalar(const char *p, const char *end)
+{
+	const char *start = p;
+	while(p < end && IS_ID(*p)) p++;
+	return p - start;
+}
+
+static long str_scalar(const char *p, const char *end, int *nlines)
+{
+	const char *start = p;
+	while(p < end && *p != '"') {
+		if(*p++ == '\n') ++*nlines;
+	}
+	return p - start;
+}
+
+static long struct_scalar(const char *p, const char *end, int *nlines)
+{
+	const char *start = p;
+	while(p < end && !IS_STRUCT(*p)) {
+		if(*p++ == '\n') ++*nlines;
+	}
+	return p - start;
+}
+
+/* the SIMD versions compute a bitmask of the characters which terminate the
+ * run, and finish off any leftover tail with the scalar version.
+ */
+#define LOWMASK(n)	((1u << (n)) - 1)
+
+#ifdef USE_SSE2
+/* unsigned a <= b for bytes: saturating subtraction yields 0 */
+#define SSE_ULE(a, b)	_mm_cmpeq_epi8(_mm_subs_epu8((a), (b)), _mm_setzero_si128())
+
+static long space_sse2(const char *p, const char *end, int *nlines)
+{
+	const char *start = p;
+	unsigned int mask, nlmask;
+	int n;
+
+	while(end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+				SSE_ULE(_mm_sub_epi8(v, _mm_set1_epi8(9)), _mm_set1_epi8(4)));
+		mask = ~_mm_movemask_epi8(ws) & 0xffff;
+		nlmask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+		if(mask) {
+			n = __builtin_ctz(mask);
+			*nlines += __builtin_popcount(nlmask & LOWMASK(n));
+			return p + n - start;
+		}
+		*nlines += __builtin_popcount(nlmask);
+		p += 16;
+	}
+	return p - start + space_scalar(p, end, nlines);
+}
+
+static long eol_sse2(const char *p, const char *end)
+{
+	const char *start = p;
+	unsigned int mask;
+
+	while(end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		if((mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))))) {
+			return p + __builtin_ctz(mask) - start;
+		}
+		p += 16;
+	}
+	return p - start + eol_scalar(p, end);
+}
+
+static long id_sse2(const char *p, const char *end)
+{
+	const char *start = p;
+	unsigned int mask;
+
+	while(end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i alpha = SSE_ULE(_mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)),
+					_mm_set1_epi8('a')), _mm_set1_epi8(25));
+		__m128i digit = SSE_ULE(_mm_sub_epi8(v, _mm_set1_epi8('0')), _mm_set1_epi8(9));
+		__m128i uscore = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+		mask = ~_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), uscore)) & 0xffff;
+		if(mask) {
+			return p + __builtin_ctz(mask) - start;
+		}
+		p += 16;
+	}
+	return p - start + id_scalar(p, end);
+}
+
+static long str_sse2(const char *p, const char *end, int *nlines)
+{
+	const char *start = p;
+	unsigned int mask, nlmask;
+	int n;
+
+	while(end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+		nlmask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+		if(mask) {
+			n = __builtin_ctz(mask);
+			*nlines += __builtin_popcount(nlmask & LOWMASK(n));
+			return p + n - start;
+		}
+		*nlines += __builtin_popcount(nlmask);
+		p += 16;
+	}
+	return p - start + str_scalar(p, end, nlines);
+}
+
+static long struct_sse2(const char *p, const char *end, int *nlines)
+{
+	const char *start = p;
+	unsigned int mask, nlmask;
+	int n;
+
+	while(end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i brace = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')),
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+		__m128i quote = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+		__m128i hash = _mm_cmpeq_epi8(v, _mm_set1_epi8('#'));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(brace, quote), hash));
+		nlmask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+		if(mask) {
+			n = __builtin_ctz(mask);
+			*nlines += __builtin_popcount(nlmask & LOWMASK(n));
+			return p + n - start;
+		}
+		*nlines += __builtin_popcount(nlmask);
+		p += 16;
+	}
+	return p - start + struct_scalar(p, end, nlines);
+}
+#endif	/* USE_SSE2 */
+
+#ifdef USE_AVX2
+#define AVX2	__attribute__((target("avx2")))
+#define AVX_ULE(a, b)	_mm256_cmpeq_epi8(_mm256_subs_epu8((a), (b)), _mm256_setzero_si256())
+
+static AVX2 long space_avx2(const char *p, const char *end, int *nlines)
+{
+	const char *start = p;
+	unsigned int mask, nlmask;
+	int n;
+
+	while(end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		__m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+				AVX_ULE(_mm256_sub_epi8(v, _mm256_set1_epi8(9)), _mm256_set1_epi8(4)));
+		mask = ~(unsigned int)_mm256_movemask_epi8(ws);
+		nlmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+		if(mask) {
+			n = __builtin_ctz(mask);
+			*nlines += __builtin_popcount(nlmask & LOWMASK(n));
+			return p + n - start;
+		}
+		*nlines += __builtin_popcount(nlmask);
+		p += 32;
+	}
+	return p - start + space_scalar(p, end, nlines);
+}
+
+static AVX2 long eol_avx2(const char *p, const char *end)
+{
+	const char *start = p;
+	unsigned int mask;
+
+	while(end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		if((mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))))) {
+			return p + __builtin_ctz(mask) - start;
+		}
+		p += 32;
+	}
+	return p - start + eol_scalar(p, end);
+}
+
+static AVX2 long id_avx2(const char *p, const char *end)
+{
+	const char *start = p;
+	unsigned int mask;
+
+	while(end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		__m256i alpha = AVX_ULE(_mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)),
+					_mm256_set1_epi8('a')), _mm256_set1_epi8(25));
+		__m256i digit = AVX_ULE(_mm256_sub_epi8(v, _mm256_set1_epi8('0')), _mm256_set1_epi8(9));
+		__m256i uscore = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+		mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), uscore));
+		if(mask) {
+			return p + __builtin_ctz(mask) - start;
+		}
+		p += 32;
+	}
+	return p - start + id_scalar(p, end);
+}
+
+static AVX2 long str_avx2(const char *p, const char *end, int *nlines)
+{
+	const char *start = p;
+	unsigned int mask, nlmask;
+	int n;
+
+	while(end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+		nlmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+		if(mask) {
+			n = __builtin_ctz(mask);
+			*nlines += __builtin_popcount(nlmask & LOWMASK(n));
+			return p + n - start;
+		}
+		*nlines += __builtin_popcount(nlmask);
+		p += 32;
+	}
+	return p - start + str_scalar(p, end, nlines);
+}
+
+static AVX2 long struct_avx2(const char *p, const char *end, int *nlines)
+{
+	const char *start = p;
+	unsigned int mask, nlmask;
+	int n;
+
+	while(end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		__m256i brace = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('}')));
+		__m256i quote = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+		__m256i hash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#'));
+		mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(brace, quote), hash));
+		nlmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+		if(mask) {
+			n = __builtin_ctz(mask);
+			*nlines += __builtin_popcount(nlmask & LOWMASK(n));
+			return p + n - start;
+		}
+		*nlines += __builtin_popcount(nlmask);
+		p += 32;
+	}
+	return p - start + struct_scalar(p, end, nlines);
+}
+#endif	/* USE_AVX2 */
+
+
+static void select_impl(void)
+{
+#ifdef USE_AVX2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		ts_scan_space = space_avx2;
+		ts_scan_eol = eol_avx2;
+		ts_scan_id = id_avx2;
+		ts_scan_str = str_avx2;
+		ts_scan_struct = struct_avx2;
+		return;
+	}
+#endif
+#ifdef USE_SSE2
+	ts_scan_space = space_sse2;
+	ts_scan_eol = eol_sse2;
+	ts_scan_id = id_sse2;
+	ts_scan_str = str_sse2;
+	ts_scan_struct = struct_sse2;
+#else
+	ts_scan_space = space_scalar;
+	ts_scan_eol = eol_scalar;
+	ts_scan_id = id_scalar;
+	ts_scan_str = str_scalar;
+	ts_scan_struct = struct_scalar;
+#endif
+}
+
+static long space_init(const char *p, const char *end, int *nlines)
+{
+	select_impl();
+	return ts_scan_space(p, end, nlines);
+}
+
+static long eol_init(const char *p, const char *end)
+{
+	select_impl();
+	return ts_scan_eol(p, end);
+}
+
+static long id_init(const char *p, const char *end)
+{
+	select_impl();
+	return ts_scan_id(p, end);
+}
+
+static long str_init(const char *p, const char *end, int *nlines)
+{
+	select_impl();
+	return ts_scan_str(p, end, nlines);
+}
+
+static long struct_init(const char *p, const char *end, int *nlines)
+{
+	select_impl();
+	return ts_scan_struct(p, end, nlines);
+}
@@ -0,0 +1,26 @@
+#ifndef TS_SCAN_H_
+#define TS_SCAN_H_
+
+/* character class scanning kernels used by the text parser. Each returns the
+ * length of the run of characters starting at p (and ending before end) which
+ * belong to the class in question. The ones which may cross line boundaries,
+ * add the number of newlines they skipped to *nlines.
+ *
+ * SSE2 and AVX2 implementations are selected at runtime when available,
+ * define TS_NO_SIMD to force the scalar versions.
+ */
+
+/* whitespace as per isspace in the C locale */
+extern long (*ts_scan_space)(const char *p, const char *end, int *nlines);
+/* anything up to the next newline */
+extern long (*ts_scan_eol)(const char *p, const char *end);
+/* identifier characters: letters, digits and underscores */
+extern long (*ts_scan_id)(const char *p, const char *end);
+/* string constant body: anything up to the next double quote */
+extern long (*ts_scan_str)(const char *p, const char *end, int *nlines);
+/* anything which isn't structurally significant when skimming over a node
+ * body: stops at braces, double quotes and comment markers
+ */
+extern long (*ts_scan_struct)(const char *p, const char *end, int *nlines);
+
+#endif	/* TS_SCAN_H_ */
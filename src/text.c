@@ -28,25 +28,155 @@ OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <float.h>
 #include <assert.h>
 #include "treestor.h"
 #include "dynarr.h"
+#include "scan.h"
+#include "intern.h"
+#include "arena.h"
+
+#if (defined(unix) || defined(__unix__) || defined(__APPLE__)) && !defined(TS_NO_THREADS)
+#define USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* size of the input buffer used when reading through a ts_io. Can be
+ * overriden at build time by passing -DTS_RDBUF_SIZE=<bytes> in CFLAGS.
+ */
+#ifndef TS_RDBUF_SIZE
+#define TS_RDBUF_SIZE	65536
+#endif
+
+/* number of recently interned names cached by each parser (power of two) */
+#define NAME_CACHE_SIZE	64
+
+struct namecache {
+	const char *name;
+	long len;
+	unsigned int hash;
+	int atom;
+};
 
 struct parser {
-	struct ts_io *io;
+	struct ts_io *io;	/* null when parsing a memory buffer */
+	int nline;
+
+	const char *buf;	/* input: either iobuf, or the memory buffer we're parsing */
+	char *iobuf;		/* input buffer, refilled from io in large blocks */
+	long bufsz;
+	long rdpos, nbuf;	/* current read position and number of valid bytes */
+
+	/* the current token is a slice of the input buffer, unless it straddled
+	 * a buffer refill, in which case it's accumulated in the token string.
+	 */
+	const char *tok;
+	long toklen;
+	struct ts_strbuf token;
+	int spill;
+	/* span_num state, kept across refills */
+	int num_prev, num_dot, num_exp, num_dig, num_edig, num_bad;
+
+	struct ts_strbuf name;	/* scratch buffer for names passed to callbacks */
+
+	/* push parser: input is fed incrementally, eof is set when we're told
+	 * there's no more. tokpos/tokline are where the current token started.
+	 */
+	int push, eof;
+	long tokpos;
+	int tokline;
+
+	struct ts_source *src;	/* lazy loading: skim child nodes instead of parsing them */
+	struct ts_arena *arena;	/* allocate the tree from this arena, if set */
+
+	struct namecache ncache[NAME_CACHE_SIZE];
+};
+
+/* input of a lazy load, kept around while any of its nodes are unexpanded */
+struct ts_source {
+	char *data;
+	size_t size;
+	int refcnt;
+	void (*release)(void *data, size_t size);
+};
+
+/* unparsed node body: from just after the opening brace, to just after the
+ * matching closing brace
+ */
+struct ts_lazy {
+	struct ts_source *src;
+	long start, end;
 	int nline;
-	char *token;
-	int nextc;
 };
 
-enum { TOK_SYM, TOK_ID, TOK_NUM, TOK_STR };
+/* TOK_WORD is a bare word which looks like a number but isn't one (5-3, 1x),
+ * which is only valid as a string value
+ */
+enum { TOK_MORE = -2, TOK_SYM = 0, TOK_ID, TOK_NUM, TOK_STR, TOK_WORD };
+
+/* parallel loading: each top-level node is parsed as a separate job */
+struct pjob {
+	struct ts_node *node;
+	struct ts_lazy *lz;
+	struct ts_arena *arena;	/* per-job sub-arena, when loading into an arena */
+	int res;
+};
+
+struct jobqueue {
+	struct pjob *jobs;
+	int njobs, next;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+/* collects array elements while parsing an array value */
+struct arrbuild {
+	float *vec;
+	struct ts_value *values;
+	int count, max_count;
+	char endsym;	/* used by the push parser */
+	struct ts_arena *arena;	/* arena of the value being built */
+};
 
+struct ts_node *ts_text_load_lazy(void *data, size_t size, void (*release)(void*, size_t));
+struct ts_node *ts_text_load_parallel(void *data, size_t size, void (*release)(void*, size_t));
+int ts_text_expand(struct ts_node *node);
+void ts_text_free_lazy(struct ts_lazy *lz);
+struct ts_node *ts_alloc_node_arena(struct ts_arena *arena);
+struct ts_attr *ts_alloc_attr_arena(struct ts_arena *arena);
+char *ts_alloc_value_str(struct ts_value *tsv, size_t len);
+int ts_value_is_int(struct ts_value *tsv);
+int ts_parse_num(const char *s, const char *end, double *num, int *inum, int *isint);
+
+static struct ts_node *parse(struct parser *pst);
+static int parse_events(struct parser *pst, struct ts_parse_callbacks *cb);
 static struct ts_node *read_node(struct parser *pstate);
+static int read_node_body(struct parser *pst, struct ts_node *node);
+static struct ts_node *skim_node(struct parser *pst);
+static void clear_node(struct ts_node *node);
+static void release_source(struct ts_source *src);
+static int parse_lazy(struct ts_node *node, struct ts_lazy *lz, int lazy, struct ts_arena *arena);
+static void run_jobs(struct pjob *jobs, int njobs);
+static int read_node_events(struct parser *pst, struct ts_parse_callbacks *cb);
 static int read_array(struct parser *pstate, struct ts_value *tsv, char endsym);
+static int arr_push_num(struct arrbuild *ab, struct parser *pst);
+static int arr_push_value(struct arrbuild *ab, struct ts_value *val);
+static int arr_finish(struct arrbuild *ab, struct ts_value *tsv);
+static void arr_destroy(struct arrbuild *ab);
 static int next_token(struct parser *pstate);
-
-static int print_attr(struct ts_attr *attr, struct ts_io *io, int level);
-static char *value_to_str(struct ts_value *value);
+static int tokstr(struct parser *pst, struct ts_value *val);
+static int tokatom(struct parser *pst, const char **namep);
+static int intern_name(struct parser *pst, const char *s, long len, const char **namep);
+static void drop_name(struct parser *pst, const char *name, int atom);
+static int tokname(struct parser *pst);
+static int tok_num(struct parser *pst, struct ts_value *val, float *vecptr);
+
+static int save_node(struct ts_node *tree, struct ts_io *io, int lvl, struct ts_strbuf *sb);
+static int print_attr(struct ts_attr *attr, struct ts_io *io, int level, struct ts_strbuf *sb);
+static int value_to_str(struct ts_value *value, struct ts_strbuf *sb);
 static int tree_level(struct ts_node *n);
 static const char *indent(int x);
 static const char *toktypestr(int type);
@@ -61,67 +191,398 @@ static const char *toktypestr(int type);
 
 #define EXPECT_SYM(c) \
 	do { \
-		if(next_token(pst) != TOK_SYM || pst->token[0] != (c)) { \
+		if(next_token(pst) != TOK_SYM || pst->tok[0] != (c)) { \
 			fprintf(stderr, "line %d: expected symbol: %c\n", pst->nline, c); \
 			goto err; \
 		} \
 	} while(0)
 
 
+/* initialize the parser to read either through io, or directly out of a
+ * memory buffer if io is null
+ */
+static int init_parser(struct parser *pst, struct ts_io *io, const void *buf, size_t len)
+{
+	memset(pst, 0, sizeof *pst);
+	pst->nline = 1;
+
+	if(io) {
+		pst->io = io;
+		pst->bufsz = TS_RDBUF_SIZE;
+		if(!(pst->iobuf = malloc(pst->bufsz))) {
+			perror("failed to allocate input buffer");
+			return -1;
+		}
+		pst->buf = pst->iobuf;
+	} else {
+		pst->buf = buf;
+		pst->nbuf = len;
+	}
+
+	ts_strbuf_init(&pst->token);
+	ts_strbuf_init(&pst->name);
+	return 0;
+}
+
+static void destroy_parser(struct parser *pst)
+{
+	free(pst->iobuf);
+	ts_strbuf_destroy(&pst->token);
+	ts_strbuf_destroy(&pst->name);
+}
+
 struct ts_node *ts_text_load(struct ts_io *io)
 {
-	char *root_name;
-	struct parser pstate, *pst = &pstate;
-	struct ts_node *node = 0;
+	struct parser pstate;
+	struct ts_node *node;
 
-	pstate.io = io;
-	pstate.nline = 1;
-	pstate.nextc = -1;
-	if(!(pstate.token = ts_dynarr_alloc(0, 1))) {
-		perror("failed to allocate token string");
+	if(init_parser(&pstate, io, 0, 0) == -1) {
+		return 0;
+	}
+	node = parse(&pstate);
+	destroy_parser(&pstate);
+	return node;
+}
+
+/* parse directly out of a memory buffer, without copying it */
+struct ts_node *ts_text_load_mem(const void *buf, size_t len)
+{
+	struct parser pstate;
+	struct ts_node *node;
+
+	init_parser(&pstate, 0, buf, len);
+	node = parse(&pstate);
+	destroy_parser(&pstate);
+	return node;
+}
+
+/* lazy load: takes ownership of the data, which is released with the
+ * supplied function when no unexpanded nodes refer to it any more
+ */
+struct ts_node *ts_text_load_lazy(void *data, size_t size, void (*release)(void*, size_t))
+{
+	struct parser pstate;
+	struct ts_node *node;
+	struct ts_source *src;
+
+	if(!(src = malloc(sizeof *src))) {
+		perror("failed to allocate lazy loading source");
+		release(data, size);
 		return 0;
 	}
+	src->data = data;
+	src->size = size;
+	src->refcnt = 1;
+	src->release = release;
 
-	EXPECT(TOK_ID);
-	if(!(root_name = strdup(pst->token))) {
-		perror("failed to allocate root node name");
-		ts_dynarr_free(pst->token);
+	init_parser(&pstate, 0, data, size);
+	pstate.src = src;
+	node = parse(&pstate);
+	destroy_parser(&pstate);
+
+	release_source(src);
+	return node;
+}
+
+/* parallel load: read the root with its children skimmed as in a lazy load,
+ * then parse the top-level children concurrently, largest first. The data is
+ * released before returning.
+ */
+static int cmp_job_size(const void *a, const void *b)
+{
+	const struct pjob *ja = a, *jb = b;
+	long sa = ja->lz->end - ja->lz->start;
+	long sb = jb->lz->end - jb->lz->start;
+	return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+struct ts_node *ts_text_load_parallel(void *data, size_t size, void (*release)(void*, size_t))
+{
+	struct ts_node *root, *c;
+	struct pjob *jobs;
+	int i, njobs, res = 0;
+
+	if(!(root = ts_text_load_lazy(data, size, release)) || !root->child_count) {
+		return root;
+	}
+
+	if(!(jobs = malloc(root->child_count * sizeof *jobs))) {
+		perror("failed to allocate parallel parsing jobs");
+		ts_free_tree(root);
+		return 0;
+	}
+	njobs = 0;
+	c = root->child_list;
+	while(c) {
+		jobs[njobs].node = c;
+		jobs[njobs].lz = c->lazy;
+		jobs[njobs].arena = 0;
+		jobs[njobs].res = 0;
+		c->lazy = 0;
+		njobs++;
+		c = c->next;
+	}
+
+	/* arenas aren't thread-safe, each job allocates from its own sub-arena */
+	if(root->arena) {
+		root->arena->owner->nforeign -= njobs;
+		for(i=0; i<njobs; i++) {
+			if(!(jobs[i].arena = ts_arena_create(root->arena->owner))) {
+				perror("failed to allocate arena");
+				res = -1;
+				break;
+			}
+			/* node indexes are allocated from the node's arena */
+			jobs[i].node->arena = jobs[i].arena;
+		}
+	}
+	qsort(jobs, njobs, sizeof *jobs, cmp_job_size);
+
+	if(res != -1) {
+		run_jobs(jobs, njobs);
+	}
+
+	/* the source refcount isn't thread-safe, drop the references afterwards */
+	for(i=0; i<njobs; i++) {
+		if(jobs[i].res == -1) {
+			res = -1;
+		}
+		ts_text_free_lazy(jobs[i].lz);
+	}
+	free(jobs);
+
+	if(res == -1) {
+		ts_free_tree(root);
 		return 0;
 	}
+	return root;
+}
+
+#ifdef USE_THREADS
+static void *job_worker(void *arg)
+{
+	struct jobqueue *q = arg;
+	struct pjob *job;
+
+	for(;;) {
+		pthread_mutex_lock(&q->lock);
+		job = q->next < q->njobs ? q->jobs + q->next++ : 0;
+		pthread_mutex_unlock(&q->lock);
+
+		if(!job) break;
+		job->res = parse_lazy(job->node, job->lz, 0, job->arena);
+	}
+	return 0;
+}
+#endif
+
+/* runs the jobs on as many threads as there are processors, or one after the
+ * other if threads aren't available
+ */
+static void run_jobs(struct pjob *jobs, int njobs)
+{
+	int i;
+#ifdef USE_THREADS
+	int nthr = 1, nstarted;
+	pthread_t *thr;
+	struct jobqueue q;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	nthr = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if(nthr > njobs) nthr = njobs;
+
+	/* the calling thread is one of the workers */
+	if(nthr > 1 && (thr = malloc((nthr - 1) * sizeof *thr))) {
+		q.jobs = jobs;
+		q.njobs = njobs;
+		q.next = 0;
+		pthread_mutex_init(&q.lock, 0);
+
+		for(nstarted=0; nstarted<nthr - 1; nstarted++) {
+			if(pthread_create(thr + nstarted, 0, job_worker, &q) != 0) {
+				break;
+			}
+		}
+		job_worker(&q);
+
+		for(i=0; i<nstarted; i++) {
+			pthread_join(thr[i], 0);
+		}
+		pthread_mutex_destroy(&q.lock);
+		free(thr);
+		return;
+	}
+#endif
+
+	for(i=0; i<njobs; i++) {
+		jobs[i].res = parse_lazy(jobs[i].node, jobs[i].lz, 0, jobs[i].arena);
+	}
+}
+
+int ts_text_expand(struct ts_node *node)
+{
+	struct ts_lazy *lz = node->lazy;
+	int res;
+
+	node->lazy = 0;
+	if(node->arena) {
+		node->arena->owner->nforeign--;
+	}
+	res = parse_lazy(node, lz, 1, node->arena);
+	ts_text_free_lazy(lz);
+	return res;
+}
+
+/* parse the body of a lazily loaded node. Its children are skimmed again if
+ * lazy is set, otherwise the whole subtree is parsed.
+ */
+static int parse_lazy(struct ts_node *node, struct ts_lazy *lz, int lazy, struct ts_arena *arena)
+{
+	struct parser pstate;
+	int res;
+
+	init_parser(&pstate, 0, lz->src->data, lz->end);
+	pstate.rdpos = lz->start;
+	pstate.nline = lz->nline;
+	pstate.arena = arena;
+	if(lazy) {
+		pstate.src = lz->src;
+	}
+
+	if((res = read_node_body(&pstate, node)) == -1) {
+		fprintf(stderr, "failed to parse node: %s\n", node->name);
+		clear_node(node);
+	}
+	destroy_parser(&pstate);
+	return res;
+}
+
+void ts_text_free_lazy(struct ts_lazy *lz)
+{
+	release_source(lz->src);
+	free(lz);
+}
+
+static void release_source(struct ts_source *src)
+{
+	if(--src->refcnt <= 0) {
+		src->release(src->data, src->size);
+		free(src);
+	}
+}
+
+int ts_text_parse(struct ts_io *io, struct ts_parse_callbacks *cb)
+{
+	struct parser pstate;
+	int res;
+
+	if(init_parser(&pstate, io, 0, 0) == -1) {
+		return -1;
+	}
+	res = parse_events(&pstate, cb);
+	destroy_parser(&pstate);
+	return res;
+}
+
+int ts_text_parse_mem(const void *buf, size_t len, struct ts_parse_callbacks *cb)
+{
+	struct parser pstate;
+	int res;
+
+	init_parser(&pstate, 0, buf, len);
+	res = parse_events(&pstate, cb);
+	destroy_parser(&pstate);
+	return res;
+}
+
+static struct ts_node *parse(struct parser *pst)
+{
+	const char *root_name;
+	int atom;
+	struct ts_node *node = 0;
+
+	EXPECT(TOK_ID);
+	if(tokname(pst) == -1) {
+		goto err;
+	}
 	EXPECT_SYM('{');
-	if(!(node = read_node(pst))) {
-		ts_dynarr_free(pst->token);
+
+	if(ts_get_load_flags() & TS_LOAD_ARENA) {
+		if(!(node = ts_alloc_arena_tree())) {
+			perror("failed to allocate arena tree");
+			goto err;
+		}
+		pst->arena = node->arena;
+	} else if(!(node = ts_alloc_node())) {
+		perror("failed to allocate treestore node");
+		goto err;
+	}
+	/* interned once the arena exists, which a name that can't be interned
+	 * is copied to
+	 */
+	if((atom = intern_name(pst, pst->name.str, pst->name.len, &root_name)) == -1) {
+		ts_free_tree(node);
+		return 0;
+	}
+	node->name = (char*)root_name;
+	node->name_atom = atom;
+
+	if(read_node_body(pst, node) == -1) {
+		ts_free_tree(node);
 		return 0;
 	}
-	node->name = root_name;
 
 err:
-	ts_dynarr_free(pst->token);
 	return node;
 }
 
+static int parse_events(struct parser *pst, struct ts_parse_callbacks *cb)
+{
+	EXPECT(TOK_ID);
+	if(tokname(pst) == -1) {
+		goto err;
+	}
+	EXPECT_SYM('{');
+	if(cb->begin_node && cb->begin_node(pst->name.str, cb->data) == -1) {
+		goto err;
+	}
+	return read_node_events(pst, cb);
+
+err:
+	return -1;
+}
+
 static int read_value(struct parser *pst, int toktype, struct ts_value *val)
 {
 	switch(toktype) {
 	case TOK_NUM:
-		ts_set_valuef(val, atof(pst->token));
+		if(tok_num(pst, val, 0) == -1) {
+			return -1;
+		}
 		break;
 
 	case TOK_SYM:
-		if(pst->token[0] == '[' || pst->token[0] == '{') {
-			char endsym = pst->token[0] + 2; /* end symbol is dist 2 from either '[' or '{' */
+		if(pst->tok[0] == '[' || pst->tok[0] == '{') {
+			char endsym = pst->tok[0] + 2; /* end symbol is dist 2 from either '[' or '{' */
 			if(read_array(pst, val, endsym) == -1) {
 				return -1;
 			}
 		} else {
-			fprintf(stderr, "read_node: unexpected rhs symbol: %c\n", pst->token[0]);
+			fprintf(stderr, "read_node: unexpected rhs symbol: %c\n", pst->tok[0]);
+			return -1;
 		}
 		break;
 
 	case TOK_ID:
 	case TOK_STR:
+	case TOK_WORD:
 	default:
-		ts_set_value_str(val, pst->token);
+		/* only string tokens which end up in the tree get copied out of the input */
+		val->type = TS_STRING;
+		if(tokstr(pst, val) == -1) {
+			return -1;
+		}
 	}
 
 	return 0;
@@ -129,31 +590,43 @@ static int read_value(struct parser *pst, int toktype, struct ts_value *val)
 
 static struct ts_node *read_node(struct parser *pst)
 {
-	int type;
 	struct ts_node *node;
 
-	if(!(node = ts_alloc_node())) {
+	if(!(node = ts_alloc_node_arena(pst->arena))) {
 		perror("failed to allocate treestore node");
 		return 0;
 	}
+	if(read_node_body(pst, node) == -1) {
+		ts_free_tree(node);
+		return 0;
+	}
+	return node;
+}
 
-	while((type = next_token(pst)) == TOK_ID) {
-		char *id;
+/* reads attributes and children into node, up to the closing brace */
+static int read_node_body(struct parser *pst, struct ts_node *node)
+{
+	int type, atom = 0;
+	const char *id = 0;
 
-		if(!(id = strdup(pst->token))) {
+	while((type = next_token(pst)) == TOK_ID) {
+		if((atom = tokatom(pst, &id)) == -1) {
 			goto err;
 		}
 
 		EXPECT(TOK_SYM);
 
-		if(pst->token[0] == '=') {
+		if(pst->tok[0] == '=') {
 			/* attribute */
 			struct ts_attr *attr;
 			int type;
 
-			if(!(attr = ts_alloc_attr())) {
+			if(!(attr = ts_alloc_attr_arena(pst->arena))) {
 				goto err;
 			}
+			attr->name = (char*)id;
+			attr->name_atom = atom;
+			id = 0;
 
 			if((type = next_token(pst)) == -1) {
 				ts_free_attr(attr);
@@ -166,326 +639,1225 @@ static struct ts_node *read_node(struct parser *pst)
 				fprintf(stderr, "failed to read value\n");
 				goto err;
 			}
-			attr->name = id;
 			ts_add_attr(node, attr);
 
-		} else if(pst->token[0] == '{') {
+		} else if(pst->tok[0] == '{') {
 			/* child */
 			struct ts_node *child;
 
-			if(!(child = read_node(pst))) {
-				ts_free_node(node);
-				return 0;
+			if(!(child = pst->src ? skim_node(pst) : read_node(pst))) {
+				drop_name(pst, id, atom);
+				return -1;
 			}
 
-			child->name = id;
+			child->name = (char*)id;
+			child->name_atom = atom;
+			id = 0;
 			ts_add_child(node, child);
 
 		} else {
-			fprintf(stderr, "unexpected token: %s\n", pst->token);
+			fprintf(stderr, "unexpected token: %.*s\n", (int)pst->toklen, pst->tok);
 			goto err;
 		}
 	}
 
-	if(type != TOK_SYM || pst->token[0] != '}') {
+	if(type != TOK_SYM || pst->tok[0] != '}') {
 		fprintf(stderr, "expected closing brace\n");
 		goto err;
 	}
-	return node;
+	return 0;
 
 err:
+	if(id) drop_name(pst, id, atom);
 	fprintf(stderr, "treestore read_node failed\n");
+	return -1;
+}
+
+/* lazy loading: record where the node body is and skip over it, by matching
+ * braces outside of strings and comments. The body is parsed by
+ * ts_text_expand when the node is first accessed.
+ */
+static struct ts_node *skim_node(struct parser *pst)
+{
+	struct ts_node *node;
+	struct ts_lazy *lz;
+	const char *p, *end;
+	int depth = 1;
+
+	if(!(node = ts_alloc_node_arena(pst->arena)) || !(lz = malloc(sizeof *lz))) {
+		perror("failed to allocate treestore node");
+		ts_free_node(node);
+		return 0;
+	}
+	lz->src = pst->src;
+	lz->start = pst->rdpos;
+	lz->nline = pst->nline;
+
+	p = pst->buf + pst->rdpos;
+	end = pst->buf + pst->nbuf;
+	while(p < end) {
+		p += ts_scan_struct(p, end, &pst->nline);
+		if(p >= end) break;
+
+		switch(*p++) {
+		case '{':
+			depth++;
+			break;
+
+		case '}':
+			if(--depth == 0) {
+				pst->rdpos = lz->end = p - pst->buf;
+				node->lazy = lz;
+				lz->src->refcnt++;
+				if(node->arena) {
+					node->arena->owner->nforeign++;	/* see ts_free_tree */
+				}
+				return node;
+			}
+			break;
+
+		case '"':
+			p += ts_scan_str(p, end, &pst->nline);
+			if(p < end) p++;
+			break;
+
+		case '#':
+			p += ts_scan_eol(p, end);
+			break;
+		}
+	}
+
+	fprintf(stderr, "line %d: unexpected EOF, expected closing brace\n", lz->nline);
+	free(lz);
 	ts_free_node(node);
 	return 0;
 }
 
+/* remove anything a failed read_node_body added to the node */
+static void clear_node(struct ts_node *node)
+{
+	while(node->attr_list) {
+		struct ts_attr *attr = node->attr_list;
+		ts_remove_attr(node, attr);
+		ts_free_attr(attr);
+	}
+	while(node->child_list) {
+		struct ts_node *child = node->child_list;
+		ts_remove_child(node, child);
+		ts_free_tree(child);
+	}
+}
+
+/* same as read_node, but instead of building a tree, calls the user-supplied
+ * callbacks as nodes and attributes are encountered. Attribute values only
+ * live for the duration of the attr callback.
+ */
+static int read_node_events(struct parser *pst, struct ts_parse_callbacks *cb)
+{
+	int type;
+
+	while((type = next_token(pst)) == TOK_ID) {
+		if(tokname(pst) == -1) {
+			goto err;
+		}
+
+		EXPECT(TOK_SYM);
+
+		if(pst->tok[0] == '=') {
+			/* attribute */
+			struct ts_value val;
+			int res;
+
+			if((type = next_token(pst)) == -1) {
+				fprintf(stderr, "read_node: unexpected EOF\n");
+				goto err;
+			}
+
+			ts_init_value(&val);
+			if(read_value(pst, type, &val) == -1) {
+				ts_destroy_value(&val);
+				fprintf(stderr, "failed to read value\n");
+				goto err;
+			}
+			res = cb->attr ? cb->attr(pst->name.str, &val, cb->data) : 0;
+			ts_destroy_value(&val);
+			if(res == -1) {
+				goto err;
+			}
+
+		} else if(pst->tok[0] == '{') {
+			/* child */
+			if(cb->begin_node && cb->begin_node(pst->name.str, cb->data) == -1) {
+				goto err;
+			}
+			if(read_node_events(pst, cb) == -1) {
+				return -1;
+			}
+
+		} else {
+			fprintf(stderr, "unexpected token: %.*s\n", (int)pst->toklen, pst->tok);
+			goto err;
+		}
+	}
+
+	if(type != TOK_SYM || pst->tok[0] != '}') {
+		fprintf(stderr, "expected closing brace\n");
+		goto err;
+	}
+	if(cb->end_node && cb->end_node(cb->data) == -1) {
+		goto err;
+	}
+	return 0;
+
+err:
+	fprintf(stderr, "treestore parsing failed\n");
+	return -1;
+}
+
 static int read_array(struct parser *pst, struct ts_value *tsv, char endsym)
 {
 	int type;
-	struct ts_value values[32];
-	int i, nval = 0;
-	int res;
+	struct arrbuild ab;
+	struct ts_value val;
+
+	memset(&ab, 0, sizeof ab);
+	ab.arena = tsv->arena;
 
 	while((type = next_token(pst)) != -1) {
-		ts_init_value(values + nval);
-		if(read_value(pst, type, values + nval) == -1) {
-			return -1;
+		if(ab.count == 0 && type == TOK_SYM && pst->tok[0] == endsym) {
+			fprintf(stderr, "read_array: line %d: empty array\n", pst->nline);
+			goto err;
 		}
-		if(nval < 31) {
-			++nval;
+
+		if(type == TOK_NUM) {
+			if(arr_push_num(&ab, pst) == -1) {
+				goto err;
+			}
 		} else {
-			ts_destroy_value(values + nval);
+			ts_init_value(&val);
+			val.arena = ab.arena;
+			if(read_value(pst, type, &val) == -1 || arr_push_value(&ab, &val) == -1) {
+				ts_destroy_value(&val);
+				goto err;
+			}
 		}
 
 		type = next_token(pst);
-		if(!(type == TOK_SYM && (pst->token[0] == ',' || pst->token[0] == endsym))) {
+		if(!(type == TOK_SYM && (pst->tok[0] == ',' || pst->tok[0] == endsym))) {
 			fprintf(stderr, "read_array: line %d: expected comma or end symbol ('%c')\n",
 					pst->nline, endsym);
-			return -1;
+			goto err;
 		}
-		if(pst->token[0] == endsym) {
+		if(pst->tok[0] == endsym) {
 			break;	/* we're done */
 		}
 	}
 
-	if(!nval) {
-		return -1;
+	if(type == -1) {
+		fprintf(stderr, "read_array: unexpected EOF\n");
+		goto err;
 	}
 
-	res = ts_set_value_arr(tsv, nval, values);
-
-	for(i=0; i<nval; i++) {
-		ts_destroy_value(values + i);
+	if(arr_finish(&ab, tsv) == -1) {
+		goto err;
 	}
-	return res;
+	return 0;
+
+err:
+	arr_destroy(&ab);
+	return -1;
 }
 
-static int nextchar(struct parser *pst)
+/* array builder: as long as all the elements are numbers, they're collected
+ * directly in the float vector. The first non-numeric element switches to
+ * collecting full ts_values, converting the numbers read so far.
+ */
+static int arr_grow(struct arrbuild *ab)
 {
-	char c;
+	int i;
+	void *tmp;
+	int newsz = ab->max_count ? ab->max_count * 2 : 16;
 
-	if(pst->nextc >= 0) {
-		c = pst->nextc;
-		pst->nextc = -1;
+	if(ab->values) {
+		if(!(tmp = realloc(ab->values, newsz * sizeof *ab->values))) {
+			return -1;
+		}
+		ab->values = tmp;
+		for(i=0; i<ab->count; i++) {
+			ts_value_moved(ab->values + i);
+		}
 	} else {
-		if(pst->io->read(&c, 1, pst->io->data) < 1) {
+		if(!(tmp = realloc(ab->vec, newsz * sizeof *ab->vec))) {
 			return -1;
 		}
+		ab->vec = tmp;
 	}
-	return c;
+	ab->max_count = newsz;
+	return 0;
 }
 
-static void ungetchar(char c, struct parser *pst)
+/* append the current number token */
+static int arr_push_num(struct arrbuild *ab, struct parser *pst)
 {
-	assert(pst->nextc == -1);
-	pst->nextc = c;
+	struct ts_value val;
+
+	if(ab->values) {
+		ts_init_value(&val);
+		val.arena = ab->arena;
+		if(tok_num(pst, &val, 0) == -1 || arr_push_value(ab, &val) == -1) {
+			ts_destroy_value(&val);
+			return -1;
+		}
+		return 0;
+	}
+
+	if(ab->count >= ab->max_count && arr_grow(ab) == -1) {
+		return -1;
+	}
+	if(tok_num(pst, 0, ab->vec + ab->count) == -1) {
+		return -1;
+	}
+	ab->count++;
+	return 0;
 }
 
-static int next_token(struct parser *pst)
+/* append a value, the array builder takes ownership of its contents */
+static int arr_push_value(struct arrbuild *ab, struct ts_value *val)
+{
+	int i;
+
+	if(ab->count >= ab->max_count && arr_grow(ab) == -1) {
+		return -1;
+	}
+
+	if(!ab->values) {
+		if(!(ab->values = malloc(ab->max_count * sizeof *ab->values))) {
+			return -1;
+		}
+		for(i=0; i<ab->count; i++) {
+			ts_init_value(ab->values + i);
+			ab->values[i].arena = ab->arena;
+			ts_set_valuef(ab->values + i, ab->vec[i]);
+		}
+		free(ab->vec);
+		ab->vec = 0;
+	}
+
+	ab->values[ab->count] = *val;
+	ts_value_moved(ab->values + ab->count++);
+	return 0;
+}
+
+/* hand the collected elements over to tsv, leaving the builder empty */
+static int arr_finish(struct arrbuild *ab, struct ts_value *tsv)
+{
+	int i;
+	void *tmp;
+	size_t size;
+
+	if(ab->values) {
+		if(ab->arena) {
+			/* the contents of the elements are already in the arena */
+			size = ab->count * sizeof *ab->values;
+			if(!(tmp = ts_arena_alloc(ab->arena, size))) {
+				return -1;
+			}
+			memcpy(tmp, ab->values, size);
+			free(ab->values);
+			ab->values = tmp;
+			for(i=0; i<ab->count; i++) {
+				ts_value_moved(ab->values + i);
+			}
+		}
+		tsv->type = TS_ARRAY;
+		tsv->array = ab->values;
+		tsv->array_size = ab->count;
+		memset(ab, 0, sizeof *ab);
+		return 0;
+	}
+
+	/* all numbers, hand over the vector. The ts_value array is only created
+	 * if someone asks for it with ts_get_value_array.
+	 */
+	if(ab->arena) {
+		size = ab->count * sizeof *ab->vec;
+		if(!(tmp = ts_arena_alloc(ab->arena, size))) {
+			return -1;
+		}
+		memcpy(tmp, ab->vec, size);
+		free(ab->vec);
+		ab->vec = tmp;
+	} else if(ab->count < ab->max_count && (tmp = realloc(ab->vec, ab->count * sizeof *ab->vec))) {
+		ab->vec = tmp;
+	}
+	tsv->type = TS_VECTOR;
+	tsv->vec = ab->vec;
+	tsv->vec_size = tsv->array_size = ab->count;
+	memset(ab, 0, sizeof *ab);
+	return 0;
+}
+
+static void arr_destroy(struct arrbuild *ab)
+{
+	int i;
+
+	free(ab->vec);
+	if(ab->values) {
+		for(i=0; i<ab->count; i++) {
+			ts_destroy_value(ab->values + i);
+		}
+		free(ab->values);
+	}
+	memset(ab, 0, sizeof *ab);
+}
+
+/* locale-independent number parser, also used for query predicates. Integers (no fraction or exponent) which
+ * fit in an int are flagged as such, and returned exactly in inum. Everything
+ * else is returned in num: when the mantissa fits in the 53 bits of a double
+ * and the exponent is small enough for the power of 10 to be exact, a single
+ * multiplication or division gives the correctly rounded result. Otherwise
+ * we're off by at most a couple of double ulps, which doesn't matter for
+ * values we're going to store as floats anyway.
+ */
+#define MAX_DIGITS	19		/* max decimal digits that fit in a 64bit mantissa */
+#define MAX_EXACT_POW	22
+
+static const double pow10tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+int ts_parse_num(const char *s, const char *end, double *num, int *inum, int *isint)
+{
+	unsigned long long mant = 0;
+	int neg = 0, ndig = 0, nsig = 0, exp10 = 0, isreal = 0;
+	int eneg = 0, eval = 0;
+
+	if(s < end && (*s == '-' || *s == '+')) {
+		neg = *s++ == '-';
+	}
+
+	while(s < end && (unsigned char)(*s - '0') <= 9) {
+		if(nsig < MAX_DIGITS) {
+			mant = mant * 10 + (*s - '0');
+			if(mant) nsig++;
+		} else {
+			exp10++;	/* drop digits which don't fit, keeping the magnitude */
+			isreal = 1;
+		}
+		ndig++;
+		s++;
+	}
+	if(s < end && *s == '.') {
+		isreal = 1;
+		s++;
+		while(s < end && (unsigned char)(*s - '0') <= 9) {
+			if(nsig < MAX_DIGITS) {
+				mant = mant * 10 + (*s - '0');
+				if(mant) nsig++;
+				exp10--;
+			}
+			ndig++;
+			s++;
+		}
+	}
+	if(!ndig) return -1;
+
+	if(s < end && (*s == 'e' || *s == 'E')) {
+		isreal = 1;
+		if(++s < end && (*s == '-' || *s == '+')) {
+			eneg = *s++ == '-';
+		}
+		if(s >= end) return -1;
+		while(s < end && (unsigned char)(*s - '0') <= 9) {
+			if(eval < 10000) {
+				eval = eval * 10 + (*s - '0');
+			}
+			s++;
+		}
+		exp10 += eneg ? -eval : eval;
+	}
+	if(s != end) return -1;
+
+	if(!isreal && mant <= (neg ? 2147483648ull : 2147483647ull)) {
+		*inum = neg ? (int)-(long long)mant : (int)mant;
+		*num = *inum;
+		*isint = 1;
+		return 0;
+	}
+
+	*num = (double)mant;
+	if(mant == 0) {
+		/* zero, whatever the exponent */
+	} else if(mant < (1ull << 53) && exp10 >= -MAX_EXACT_POW && exp10 <= MAX_EXACT_POW) {
+		if(exp10 < 0) {
+			*num /= pow10tab[-exp10];
+		} else {
+			*num *= pow10tab[exp10];
+		}
+	} else {
+		*num *= pow(10.0, exp10);
+	}
+	if(neg) *num = -*num;
+	*isint = 0;
+	return 0;
+}
+
+/* parse the current number token into val. If vecptr is non-null, it's
+ * written there as a float instead, without touching val.
+ */
+static int tok_num(struct parser *pst, struct ts_value *val, float *vecptr)
+{
+	double num;
+	int inum, isint;
+
+	if(ts_parse_num(pst->tok, pst->tok + pst->toklen, &num, &inum, &isint) == -1) {
+		fprintf(stderr, "line %d: invalid number: %.*s\n", pst->nline, (int)pst->toklen, pst->tok);
+		return -1;
+	}
+
+	if(vecptr) {
+		*vecptr = isint ? (float)inum : (float)num;
+		return 0;
+	}
+	if(isint) {
+		return ts_set_valuei(val, inum);
+	}
+	return ts_set_valuef(val, num);
+}
+
+/* copy the current token to the name buffer, to be passed to callbacks */
+static int tokname(struct parser *pst)
+{
+	ts_strbuf_clear(&pst->name);
+	if(ts_strbuf_append(&pst->name, pst->tok, pst->toklen) == -1) {
+		perror("failed to allocate name");
+		return -1;
+	}
+	return 0;
+}
+
+static int tokatom(struct parser *pst, const char **namep)
+{
+	return intern_name(pst, pst->tok, pst->toklen, namep);
+}
+
+/* names are interned in the global table, which needs locking. The parser
+ * keeps the most recently seen names in a small cache to avoid that. Names
+ * which can't be interned because the table is full are copied, and the copy
+ * must be handed to a node or attribute, or released with drop_name.
+ */
+static int intern_name(struct parser *pst, const char *s, long len, const char **namep)
+{
+	unsigned int hash = ts_intern_hash(s, len);
+	struct namecache *nc = pst->ncache + (hash & (NAME_CACHE_SIZE - 1));
+
+	if(nc->name && nc->hash == hash && nc->len == len && memcmp(nc->name, s, len) == 0) {
+		*namep = nc->name;
+		return nc->atom;
+	}
+
+	if((nc->atom = ts_intern_len(s, len, hash, namep)) <= 0) {
+		nc->name = 0;
+		if(nc->atom == -1 || !(*namep = ts_name_copy(pst->arena, s, len))) {
+			perror("failed to intern name");
+			return -1;
+		}
+		return 0;
+	}
+	nc->name = *namep;
+	nc->len = len;
+	nc->hash = hash;
+	return nc->atom;
+}
+
+static void drop_name(struct parser *pst, const char *name, int atom)
+{
+	if(!atom && !pst->arena) {
+		free((char*)name);
+	}
+}
+
+/* copy the current token to the string of val */
+static int tokstr(struct parser *pst, struct ts_value *val)
+{
+	if(!(val->str = ts_alloc_value_str(val, pst->toklen))) {
+		return -1;
+	}
+	memcpy(val->str, pst->tok, pst->toklen);
+	val->str[pst->toklen] = 0;
+	return 0;
+}
+
+/* returns -1 at the end of the input, or TOK_MORE when the push parser needs
+ * to be fed more data before it can continue
+ */
+static int refill(struct parser *pst)
+{
+	long sz;
+
+	if(!pst->io) {
+		return pst->push && !pst->eof ? TOK_MORE : -1;
+	}
+	if((sz = pst->io->read(pst->iobuf, pst->bufsz, pst->io->data)) <= 0) {
+		return -1;
+	}
+	pst->nbuf = sz;
+	pst->rdpos = 0;
+	return 0;
+}
+
+/* span functions return the length of the run of characters starting at p,
+ * which belong to the token class in question
+ */
+/* numbers are scanned as a whole word of digits, letters, dots and signs, and
+ * checked on the way: digits with at most one dot, followed by an optional
+ * exponent, with signs only at the start and right after the exponent marker.
+ * Words which fail the check (num_bad) are bare strings, like "5-3" or "1x".
+ */
+static long span_num(struct parser *pst, const char *p, const char *end)
 {
 	int c;
+	const char *start = p;
 
-	DYNARR_CLEAR(pst->token);
+	while(p < end) {
+		c = (unsigned char)*p;
+		if(isdigit(c)) {
+			if(pst->num_exp) {
+				pst->num_edig = 1;
+			} else {
+				pst->num_dig = 1;
+			}
+		} else if(c == '.') {
+			if(pst->num_dot || pst->num_exp) pst->num_bad = 1;
+			pst->num_dot = 1;
+		} else if(c == 'e' || c == 'E') {
+			if(pst->num_exp || !pst->num_dig) pst->num_bad = 1;
+			pst->num_exp = 1;
+		} else if(c == '-' || c == '+') {
+			if(pst->num_prev && pst->num_prev != 'e' && pst->num_prev != 'E') {
+				pst->num_bad = 1;
+			}
+		} else if(isalpha(c) || c == '_') {
+			pst->num_bad = 1;
+		} else {
+			break;
+		}
+		pst->num_prev = c;
+		p++;
+	}
+	return p - start;
+}
 
-	/* skip whitespace */
-	while((c = nextchar(pst)) != -1) {
-		if(c == '#') { /* skip to end of line */
-			while((c = nextchar(pst)) != -1 && c != '\n');
-			if(c == -1) return -1;
+static long span_id(struct parser *pst, const char *p, const char *end)
+{
+	return ts_scan_id(p, end);
+}
+
+static long span_str(struct parser *pst, const char *p, const char *end)
+{
+	return ts_scan_str(p, end, &pst->nline);
+}
+
+static int spill(struct parser *pst, long start, long end)
+{
+	if(!pst->spill) {
+		ts_strbuf_clear(&pst->token);
+		pst->spill = 1;
+	}
+	if(ts_strbuf_append(&pst->token, pst->buf + start, end - start) == -1) {
+		perror("failed to allocate token string");
+		return -1;
+	}
+	return 0;
+}
+
+/* extends the current token, which starts at start, with the run of characters
+ * accepted by the span function, refilling the input buffer as necessary.
+ * If the push parser runs out of input in the middle of the token, it backs
+ * up to the start of the token, to rescan it when more data arrive.
+ */
+static int scan_token(struct parser *pst, long start,
+		long (*span)(struct parser*, const char*, const char*))
+{
+	int res;
+
+	pst->spill = 0;
+
+	for(;;) {
+		pst->rdpos += span(pst, pst->buf + pst->rdpos, pst->buf + pst->nbuf);
+		if(pst->rdpos < pst->nbuf) break;
+
+		/* ran off the end of the buffer, keep what we have so far and refill */
+		if(spill(pst, start, pst->rdpos) == -1) {
+			return -1;
+		}
+		start = pst->rdpos;
+		if((res = refill(pst)) == TOK_MORE) {
+			pst->rdpos = pst->tokpos;
+			pst->nline = pst->tokline;
+			return TOK_MORE;
+		}
+		if(res == -1) break;
+		start = 0;
+	}
+
+	if(pst->spill) {
+		if(spill(pst, start, pst->rdpos) == -1) {
+			return -1;
+		}
+		pst->tok = pst->token.str;
+		pst->toklen = pst->token.len;
+	} else {
+		pst->tok = pst->buf + start;
+		pst->toklen = pst->rdpos - start;
+	}
+	return 0;
+}
+
+static int next_token(struct parser *pst)
+{
+	int c, res;
+	long start;
+
+	/* skip whitespace and comments */
+	for(;;) {
+		if(pst->rdpos >= pst->nbuf && (res = refill(pst)) < 0) {
+			return res;
+		}
+		pst->rdpos += ts_scan_space(pst->buf + pst->rdpos, pst->buf + pst->nbuf, &pst->nline);
+		if(pst->rdpos >= pst->nbuf) continue;
+
+		if((c = (unsigned char)pst->buf[pst->rdpos]) != '#') break;
+
+		/* skip comment to the end of the line */
+		start = pst->rdpos;
+		while((pst->rdpos += ts_scan_eol(pst->buf + pst->rdpos, pst->buf + pst->nbuf)) >= pst->nbuf) {
+			if((res = refill(pst)) < 0) {
+				if(res == TOK_MORE) {
+					pst->rdpos = start;	/* rescan the whole comment next time */
+				}
+				return res;
+			}
 		}
-		if(!isspace(c)) break;
-		if(c == '\n') ++pst->nline;
 	}
-	if(c == -1) return -1;
 
-	DYNARR_STRPUSH(pst->token, c);
+	start = pst->tokpos = pst->rdpos++;
+	pst->tokline = pst->nline;
 
-	if(isdigit(c) || c == '-' || c == '+') {
-		/* token is a number */
-		int found_dot = 0;
-		while((c = nextchar(pst)) != -1 &&
-				(isdigit(c) || (c == '.' && !found_dot))) {
-			DYNARR_STRPUSH(pst->token, c);
-			if(c == '.') found_dot = 1;
+	if(isdigit(c) || c == '-' || c == '+' || c == '.') {
+		/* token is a number, or a bare word which only starts like one */
+		pst->rdpos = start;
+		pst->num_prev = pst->num_dot = pst->num_exp = 0;
+		pst->num_dig = pst->num_edig = pst->num_bad = 0;
+		if((res = scan_token(pst, start, span_num)) < 0) {
+			return res;
+		}
+		if(pst->num_bad || !pst->num_dig || (pst->num_exp && !pst->num_edig)) {
+			return TOK_WORD;
 		}
-		if(c != -1) ungetchar(c, pst);
 		return TOK_NUM;
 	}
 	if(isalpha(c)) {
 		/* token is an identifier */
-		while((c = nextchar(pst)) != -1 && (isalnum(c) || c == '_')) {
-			DYNARR_STRPUSH(pst->token, c);
-		}
-		if(c != -1) ungetchar(c, pst);
-		return TOK_ID;
+		return (res = scan_token(pst, start, span_id)) < 0 ? res : TOK_ID;
 	}
 	if(c == '"') {
-		/* token is a string constant, remove the opening quote */
-		DYNARR_STRPOP(pst->token);
-		while((c = nextchar(pst)) != -1 && c != '"') {
-			DYNARR_STRPUSH(pst->token, c);
-			if(c == '\n') ++pst->nline;
+		/* token is a string constant, leave out the quotes */
+		if((res = scan_token(pst, start + 1, span_str)) < 0) {
+			return res;
 		}
-		if(c != '"') {
+		if(pst->rdpos >= pst->nbuf) {
 			return -1;
 		}
+		pst->rdpos++;
 		return TOK_STR;
 	}
+
+	pst->tok = pst->buf + start;
+	pst->toklen = 1;
 	return TOK_SYM;
 }
 
-int ts_text_save(struct ts_node *tree, struct ts_io *io)
+/* ---- push parser ----
+ * Same grammar as read_node/read_array, but driven one token at a time by an
+ * explicit state machine, so that parsing can stop whenever the input runs
+ * out, and resume when ts_parser_feed is called again.
+ */
+enum {
+	PS_ROOT_NAME,	/* expecting the root node name */
+	PS_ROOT_OPEN,	/* expecting the opening brace of the root node */
+	PS_NODE,		/* in a node: expecting an attribute/child name or a closing brace */
+	PS_NODE_ID,		/* after a name: expecting '=' or '{' */
+	PS_VALUE,		/* after '=': expecting a value */
+	PS_ARR_ELEM,	/* in an array: expecting an element */
+	PS_ARR_SEP,		/* in an array: expecting a comma or the end symbol */
+	PS_DONE,
+	PS_ERROR
+};
+
+struct ts_parser {
+	struct parser pst;
+	int state;
+
+	struct ts_node *root, *cur;
+
+	/* stack of arrays being parsed, for nested arrays */
+	struct arrbuild *arrstack;
+	int arrtop, arrmax;
+
+	struct ts_strbuf pending;	/* unconsumed input left over from the last feed */
+};
+
+static void reset_parser(struct ts_parser *p);
+static int push_run(struct ts_parser *p);
+
+struct ts_parser *ts_alloc_parser(void)
 {
-	char *buf;
-	struct ts_node *c;
-	struct ts_attr *attr;
-	int lvl = tree_level(tree);
-	int sz, inline_attr, res = -1;
+	struct ts_parser *p;
 
-	if(!(buf = malloc(lvl + strlen(tree->name) + 4))) {
-		perror("ts_text_save failed to allocate buffer");
-		goto end;
+	if(!(p = calloc(1, sizeof *p))) {
+		perror("failed to allocate parser");
+		return 0;
 	}
+	init_parser(&p->pst, 0, 0, 0);
+	p->pst.push = 1;
+	ts_strbuf_init(&p->pending);
+	return p;
+}
 
-	if(tree->child_list || (tree->attr_list && tree->attr_list->next)) {
-		inline_attr = 0;
+void ts_free_parser(struct ts_parser *p)
+{
+	if(!p) return;
+
+	reset_parser(p);
+	free(p->arrstack);
+	destroy_parser(&p->pst);
+	ts_strbuf_destroy(&p->pending);
+	free(p);
+}
+
+int ts_parser_feed(struct ts_parser *p, const void *buf, size_t len)
+{
+	struct parser *pst = &p->pst;
+	long left;
+	int res;
+
+	if(p->state == PS_ERROR) return -1;
+
+	if(p->pending.len > 0) {
+		/* a partial token was left over, append the new data after it */
+		if(ts_strbuf_append(&p->pending, buf, len) == -1) {
+			perror("ts_parser_feed: failed to allocate input buffer");
+			return -1;
+		}
+		pst->buf = p->pending.str;
+		pst->nbuf = p->pending.len;
 	} else {
-		inline_attr = 1;
+		/* otherwise parse straight out of the caller's buffer */
+		pst->buf = buf;
+		pst->nbuf = len;
 	}
+	pst->rdpos = 0;
 
-	sz = sprintf(buf, "%s%s {", indent(lvl), tree->name);
-	if(!inline_attr) {
-		strcat(buf, "\n");
-		sz++;
+	res = push_run(p);
+
+	/* keep whatever wasn't consumed for the next round */
+	left = pst->nbuf - pst->rdpos;
+	if(pst->buf == p->pending.str) {
+		memmove(p->pending.str, p->pending.str + pst->rdpos, left);
+		p->pending.len = left;
+	} else {
+		ts_strbuf_clear(&p->pending);
+		if(left > 0 && ts_strbuf_append(&p->pending, pst->buf + pst->rdpos, left) == -1) {
+			perror("ts_parser_feed: failed to allocate input buffer");
+			res = -1;
+		}
 	}
-	if(io->write(buf, sz, io->data) < sz) {
-		goto end;
+	pst->buf = p->pending.str;
+	pst->nbuf = p->pending.len;
+	pst->rdpos = 0;
+	return res;
+}
+
+struct ts_node *ts_parser_finish(struct ts_parser *p)
+{
+	struct ts_node *root = 0;
+
+	p->pst.eof = 1;
+	if(push_run(p) != -1 && p->state == PS_DONE) {
+		root = p->root;
+		p->root = 0;
 	}
 
-	attr = tree->attr_list;
-	while(attr) {
-		if(print_attr(attr, io, inline_attr ? -1 : lvl) == -1) {
-			goto end;
-		}
-		attr = attr->next;
+	reset_parser(p);
+	return root;
+}
+
+static void reset_parser(struct ts_parser *p)
+{
+	ts_free_tree(p->root);
+	p->root = p->cur = 0;
+
+	while(p->arrtop > 0) {
+		arr_destroy(p->arrstack + --p->arrtop);
 	}
 
-	c = tree->child_list;
-	while(c) {
-		if(ts_text_save(c, io) == -1) {
-			goto end;
-		}
-		c = c->next;
+	ts_strbuf_clear(&p->pending);
+	p->pst.buf = 0;
+	p->pst.rdpos = p->pst.nbuf = 0;
+	p->pst.nline = 1;
+	p->pst.eof = 0;
+	p->pst.arena = 0;
+	p->state = PS_ROOT_NAME;
+}
+
+static int push_array(struct ts_parser *p, char endsym)
+{
+	if(p->arrtop >= p->arrmax) {
+		int newmax = p->arrmax ? p->arrmax * 2 : 4;
+		void *tmp = realloc(p->arrstack, newmax * sizeof *p->arrstack);
+		if(!tmp) return -1;
+		p->arrstack = tmp;
+		p->arrmax = newmax;
 	}
+	memset(p->arrstack + p->arrtop, 0, sizeof *p->arrstack);
+	p->arrstack[p->arrtop].arena = p->pst.arena;
+	p->arrstack[p->arrtop++].endsym = endsym;
+	return 0;
+}
 
-	if(inline_attr) {
-		sz = sprintf(buf, "}\n");
-	} else {
-		sz = sprintf(buf, "%s}\n", indent(lvl));
+/* attach a completed attribute value to the current node */
+static int push_attr(struct ts_parser *p, struct ts_value *val)
+{
+	struct ts_attr *attr;
+	const char *name;
+
+	if(!(attr = ts_alloc_attr_arena(p->pst.arena))) {
+		return -1;
+	}
+	if((attr->name_atom = intern_name(&p->pst, p->pst.name.str, p->pst.name.len, &name)) == -1) {
+		ts_free_attr(attr);
+		return -1;
+	}
+	attr->name = (char*)name;
+	attr->val = *val;
+	ts_value_moved(&attr->val);
+	ts_add_attr(p->cur, attr);
+	return 0;
+}
+
+/* a scalar value or a complete array goes either into the enclosing array, or
+ * if there isn't one, into a new attribute.
+ */
+static int push_value(struct ts_parser *p, struct ts_value *val)
+{
+	if(p->arrtop > 0) {
+		p->state = PS_ARR_SEP;
+		return arr_push_value(p->arrstack + p->arrtop - 1, val);
+	}
+	p->state = PS_NODE;
+	return push_attr(p, val);
+}
+
+static int push_run(struct ts_parser *p)
+{
+	struct parser *pst = &p->pst;
+	const char *name;
+	struct ts_node *node;
+	struct ts_value val;
+	struct arrbuild *arr;
+	int type = 0;
+
+	if(p->state == PS_ERROR) return -1;
+
+	while(p->state != PS_DONE && (type = next_token(pst)) != TOK_MORE) {
+		if(type == -1) {
+			goto err;
+		}
+
+		switch(p->state) {
+		case PS_ROOT_NAME:
+		case PS_NODE:
+			if(type == TOK_ID) {
+				if(tokname(pst) == -1) goto err;
+				p->state = p->state == PS_ROOT_NAME ? PS_ROOT_OPEN : PS_NODE_ID;
+				break;
+			}
+			if(p->state == PS_NODE && type == TOK_SYM && pst->tok[0] == '}') {
+				/* done with this node, go back to the parent */
+				if(!(p->cur = p->cur->parent)) {
+					p->state = PS_DONE;
+				}
+				break;
+			}
+			fprintf(stderr, "line %d: expected %s\n", pst->nline,
+					p->state == PS_NODE ? "identifier or closing brace" : "identifier");
+			goto err;
+
+		case PS_ROOT_OPEN:
+		case PS_NODE_ID:
+			if(type != TOK_SYM) {
+				fprintf(stderr, "line %d: expected symbol\n", pst->nline);
+				goto err;
+			}
+			if(pst->tok[0] == '=' && p->state == PS_NODE_ID) {
+				p->state = PS_VALUE;
+				break;
+			}
+			if(pst->tok[0] == '{') {
+				if(p->cur) {
+					node = ts_alloc_node_arena(pst->arena);
+				} else if(ts_get_load_flags() & TS_LOAD_ARENA) {
+					if((node = ts_alloc_arena_tree())) {
+						pst->arena = node->arena;
+					}
+				} else {
+					node = ts_alloc_node();
+				}
+				if(!node) {
+					perror("failed to allocate treestore node");
+					goto err;
+				}
+				if((node->name_atom = intern_name(pst, pst->name.str, pst->name.len, &name)) == -1) {
+					ts_free_tree(node);
+					goto err;
+				}
+				node->name = (char*)name;
+				if(p->cur) {
+					ts_add_child(p->cur, node);
+				} else {
+					p->root = node;
+				}
+				p->cur = node;
+				p->state = PS_NODE;
+				break;
+			}
+			fprintf(stderr, "unexpected token: %.*s\n", (int)pst->toklen, pst->tok);
+			goto err;
+
+		case PS_VALUE:
+		case PS_ARR_ELEM:
+			if(type == TOK_SYM) {
+				if(pst->tok[0] == '[' || pst->tok[0] == '{') {
+					if(push_array(p, pst->tok[0] + 2) == -1) goto err;
+					p->state = PS_ARR_ELEM;
+					break;
+				}
+				if(p->state == PS_ARR_ELEM && pst->tok[0] == p->arrstack[p->arrtop - 1].endsym &&
+						p->arrstack[p->arrtop - 1].count == 0) {
+					fprintf(stderr, "line %d: empty array\n", pst->nline);
+				} else {
+					fprintf(stderr, "line %d: unexpected rhs symbol: %c\n", pst->nline, pst->tok[0]);
+				}
+				goto err;
+			}
+			if(type == TOK_NUM && p->arrtop > 0) {
+				if(arr_push_num(p->arrstack + p->arrtop - 1, pst) == -1) goto err;
+				p->state = PS_ARR_SEP;
+				break;
+			}
+			ts_init_value(&val);
+			val.arena = pst->arena;
+			if(read_value(pst, type, &val) == -1 || push_value(p, &val) == -1) {
+				ts_destroy_value(&val);
+				goto err;
+			}
+			break;
+
+		case PS_ARR_SEP:
+			arr = p->arrstack + p->arrtop - 1;
+			if(type == TOK_SYM && pst->tok[0] == ',') {
+				p->state = PS_ARR_ELEM;
+				break;
+			}
+			if(type == TOK_SYM && pst->tok[0] == arr->endsym) {
+				ts_init_value(&val);
+				val.arena = pst->arena;
+				if(arr_finish(arr, &val) == -1) goto err;
+				p->arrtop--;
+				if(push_value(p, &val) == -1) {
+					ts_destroy_value(&val);
+					goto err;
+				}
+				break;
+			}
+			fprintf(stderr, "line %d: expected comma or end symbol ('%c')\n", pst->nline, arr->endsym);
+			goto err;
+		}
 	}
-	if(io->write(buf, sz, io->data) < sz) {
-		goto end;
+	return 0;
+
+err:
+	if(type == -1 && pst->eof) {
+		fprintf(stderr, "line %d: unexpected end of input\n", pst->nline);
 	}
-	res = 0;
-end:
-	free(buf);
+	p->state = PS_ERROR;
+	return -1;
+}
+
+int ts_text_save(struct ts_node *tree, struct ts_io *io)
+{
+	int res;
+	struct ts_strbuf sb;
+
+	ts_strbuf_init(&sb);
+	res = save_node(tree, io, tree_level(tree), &sb);
+	ts_strbuf_destroy(&sb);
 	return res;
 }
 
 #define IO_WRITE(buf, sz) \
 	do { \
 		if(io->write(buf, sz, io->data) < sz) { \
-			fprintf(stderr, "failed to write %d bytes\n", sz); \
-			goto end; \
+			fprintf(stderr, "failed to write %ld bytes\n", (long)(sz)); \
+			return -1; \
 		} \
 	} while(0)
 
-static int print_attr(struct ts_attr *attr, struct ts_io *io, int level)
+/* sb is a scratch buffer shared by the whole save, used to assemble each line
+ * before writing it out
+ */
+static int save_node(struct ts_node *tree, struct ts_io *io, int lvl, struct ts_strbuf *sb)
 {
-	char buf[64];
-	char *val = 0;
-	int sz, slen, res = -1;
+	struct ts_node *c;
+	struct ts_attr *attr;
+	int inline_attr;
 
-	if(attr->val.type == TS_STRING) {
-		slen = strlen(attr->val.str);
+	if(ts_expand_node(tree) == -1) {
+		return -1;
+	}
 
-		if(level >= 0) {
-			sz = sprintf(buf, "%s%s = \"", indent(level + 1), attr->name);
-			IO_WRITE(buf, sz);
-			IO_WRITE(attr->val.str, slen);
-			IO_WRITE("\"\n", 2);
-		} else {
-			sz = sprintf(buf, " %s = \"", attr->name);
-			IO_WRITE(buf, sz);
-			IO_WRITE(attr->val.str, slen);
-			IO_WRITE("\" ", 2);
+	if(tree->child_list || (tree->attr_list && tree->attr_list->next)) {
+		inline_attr = 0;
+	} else {
+		inline_attr = 1;
+	}
+
+	ts_strbuf_clear(sb);
+	if(ts_strbuf_appendstr(sb, indent(lvl)) == -1 || ts_strbuf_appendstr(sb, tree->name) == -1 ||
+			ts_strbuf_appendstr(sb, inline_attr ? " {" : " {\n") == -1) {
+		return -1;
+	}
+	IO_WRITE(sb->str, sb->len);
+
+	attr = tree->attr_list;
+	while(attr) {
+		if(print_attr(attr, io, inline_attr ? -1 : lvl, sb) == -1) {
+			return -1;
 		}
-		return 0;
+		attr = attr->next;
 	}
 
-	if(!(val = value_to_str(&attr->val))) {
+	c = tree->child_list;
+	while(c) {
+		if(save_node(c, io, lvl + 1, sb) == -1) {
+			return -1;
+		}
+		c = c->next;
+	}
+
+	ts_strbuf_clear(sb);
+	if((!inline_attr && ts_strbuf_appendstr(sb, indent(lvl)) == -1) ||
+			ts_strbuf_appendstr(sb, "}\n") == -1) {
 		return -1;
 	}
-	slen = ts_dynarr_size(val) - 1;
+	IO_WRITE(sb->str, sb->len);
+	return 0;
+}
+
+static int print_attr(struct ts_attr *attr, struct ts_io *io, int level, struct ts_strbuf *sb)
+{
+	ts_strbuf_clear(sb);
 
 	if(level >= 0) {
-		sz = sprintf(buf, "%s%s = ", indent(level + 1), attr->name);
-		IO_WRITE(buf, sz);
-		IO_WRITE(val, slen);
-		IO_WRITE("\n", 1);
+		if(ts_strbuf_appendstr(sb, indent(level + 1)) == -1) {
+			return -1;
+		}
 	} else {
-		sz = sprintf(buf, " %s = ", attr->name);
-		IO_WRITE(buf, sz);
-		IO_WRITE(val, slen);
-		IO_WRITE(" ", 1);
+		if(ts_strbuf_appendc(sb, ' ') == -1) {
+			return -1;
+		}
+	}
+	if(ts_strbuf_appendstr(sb, attr->name) == -1 || ts_strbuf_appendstr(sb, " = ") == -1 ||
+			value_to_str(&attr->val, sb) == -1 ||
+			ts_strbuf_appendc(sb, level >= 0 ? '\n' : ' ') == -1) {
+		return -1;
 	}
 
-	res = 0;
-end:
-	ts_dynarr_free(val);
-	return res;
+	IO_WRITE(sb->str, sb->len);
+	return 0;
 }
 
-static char *append_dynstr(char *dest, char *s)
+/* appends the textual representation of the value to sb */
+/* floats are written with enough digits to read back the same value, and
+ * infinities as an exponent too large for a float, which reads back as one
+ */
+static void float_to_str(char *buf, float x)
 {
-	while(*s) {
-		DYNARR_STRPUSH(dest, *s++);
+	if(x > FLT_MAX) {
+		strcpy(buf, "1e999");
+	} else if(x < -FLT_MAX) {
+		strcpy(buf, "-1e999");
+	} else {
+		sprintf(buf, "%.9g", x);
 	}
-	return dest;
 }
 
-static char *value_to_str(struct ts_value *value)
+static int value_to_str(struct ts_value *value, struct ts_strbuf *sb)
 {
 	int i;
 	char buf[128];
-	char *str, *valstr;
-
-	if(!(str = ts_dynarr_alloc(0, 1))) {
-		return 0;
-	}
 
 	switch(value->type) {
 	case TS_NUMBER:
-		sprintf(buf, "%f", value->fnum);
-		str = append_dynstr(str, buf);
-		break;
+		/* integers are written exactly, and floats with enough digits to
+		 * read back the same value
+		 */
+		if(ts_value_is_int(value)) {
+			sprintf(buf, "%d", value->inum);
+		} else {
+			float_to_str(buf, value->fnum);
+		}
+		return ts_strbuf_appendstr(sb, buf);
 
 	case TS_VECTOR:
-		DYNARR_STRPUSH(str, '[');
+		if(ts_strbuf_appendc(sb, '[') == -1) {
+			return -1;
+		}
 		for(i=0; i<value->vec_size; i++) {
-			if(i == 0) {
-				sprintf(buf, "%f", value->vec[i]);
-			} else {
-				sprintf(buf, ", %f", value->vec[i]);
+			if(i > 0 && ts_strbuf_appendstr(sb, ", ") == -1) {
+				return -1;
+			}
+			float_to_str(buf, value->vec[i]);
+			if(ts_strbuf_appendstr(sb, buf) == -1) {
+				return -1;
 			}
-			str = append_dynstr(str, buf);
 		}
-		DYNARR_STRPUSH(str, ']');
-		break;
+		return ts_strbuf_appendc(sb, ']');
 
 	case TS_ARRAY:
-		DYNARR_STRPUSH(str, '[');
+		if(ts_strbuf_appendc(sb, '[') == -1) {
+			return -1;
+		}
 		for(i=0; i<value->array_size; i++) {
-			if(i > 0) {
-				str = append_dynstr(str, ", ");
+			if(i > 0 && ts_strbuf_appendstr(sb, ", ") == -1) {
+				return -1;
 			}
-			if(!(valstr = value_to_str(value->array + i))) {
-				ts_dynarr_free(str);
-				return 0;
+			if(value_to_str(value->array + i, sb) == -1) {
+				return -1;
 			}
-			str = append_dynstr(str, valstr);
-			ts_dynarr_free(valstr);
 		}
-		DYNARR_STRPUSH(str, ']');
-		break;
+		return ts_strbuf_appendc(sb, ']');
 
 	default:
-		str = append_dynstr(str, "\"");
-		str = append_dynstr(str, value->str);
-		str = append_dynstr(str, "\"");
+		break;
 	}
 
-	return str;
+	if(ts_strbuf_appendc(sb, '"') == -1 || ts_strbuf_appendstr(sb, value->str) == -1) {
+		return -1;
+	}
+	return ts_strbuf_appendc(sb, '"');
 }
 
 static int tree_level(struct ts_node *n)
@@ -510,6 +1882,8 @@ static const char *toktypestr(int type)
 		return "number";
 	case TOK_STR:
 		return "string";
+	case TOK_WORD:
+		return "word";
 	case TOK_SYM:
 		return "symbol";
 	}
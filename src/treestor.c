@@ -28,8 +28,12 @@ OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include "treestor.h"
+#include "intern.h"
+#include "arena.h"
+#include "pool.h"
 
 #ifdef WIN32
 #include <malloc.h>
@@ -37,15 +41,94 @@ OF SUCH DAMAGE.
 #include <alloca.h>
 #endif
 
+#if defined(unix) || defined(__unix__) || defined(__APPLE__)
+#define USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if (defined(unix) || defined(__unix__) || defined(__APPLE__)) && !defined(TS_NO_THREADS)
+#include <pthread.h>
+
+/* serializes the on-demand conversions of ts_get_value_str/ts_get_value_array */
+static pthread_mutex_t conv_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CONV_LOCK()		pthread_mutex_lock(&conv_lock)
+#define CONV_UNLOCK()	pthread_mutex_unlock(&conv_lock)
+#else
+#define CONV_LOCK()
+#define CONV_UNLOCK()
+#endif
+
+/* the converted buffers are published with a release store, so that readers
+ * which find the pointer set also see what it points to
+ */
+#ifdef __GNUC__
+#define LOAD_PTR(p)		__atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define STORE_PTR(p, x)	__atomic_store_n(&(p), x, __ATOMIC_RELEASE)
+#else
+#define LOAD_PTR(p)		(p)
+#define STORE_PTR(p, x)	((p) = (x))
+#endif
+
 struct ts_node *ts_text_load(struct ts_io *io);
+struct ts_node *ts_text_load_mem(const void *buf, size_t len);
+int ts_text_parse(struct ts_io *io, struct ts_parse_callbacks *cb);
+int ts_text_parse_mem(const void *buf, size_t len, struct ts_parse_callbacks *cb);
 int ts_text_save(struct ts_node *tree, struct ts_io *io);
+struct ts_node *ts_text_load_lazy(void *data, size_t size, void (*release)(void*, size_t));
+struct ts_node *ts_text_load_parallel(void *data, size_t size, void (*release)(void*, size_t));
+int ts_text_expand(struct ts_node *node);
+void ts_text_free_lazy(struct ts_lazy *lz);
+
+struct ts_node *ts_alloc_node_arena(struct ts_arena *arena);
+struct ts_attr *ts_alloc_attr_arena(struct ts_arena *arena);
 
 struct ts_node *ts_bin_load(struct ts_io *io);
+struct ts_node *ts_bin_load_mem(const void *buf, size_t len);
+int ts_bin_check(const void *buf, size_t len);
 int ts_bin_save(struct ts_node *tree, struct ts_io *io);
 
+static void build_attr_index(struct ts_node *node);
+static void build_child_index(struct ts_node *node);
+static void drop_attr_index(struct ts_node *node);
+static void drop_child_index(struct ts_node *node);
+static void touch_node(struct ts_node *node);
+static void free_lcache(struct ts_node *node);
+
 static long io_read(void *buf, size_t bytes, void *uptr);
 static long io_write(const void *buf, size_t bytes, void *uptr);
 
+/* ts_load_io reads the first few bytes of the input to pick a loader, and
+ * hands them back to it before the rest of the stream
+ */
+#define PEEK_SIZE	8
+
+struct peekio {
+	struct ts_io *io;
+	char buf[PEEK_SIZE];
+	int len, pos;
+};
+static long peekio_read(void *buf, size_t bytes, void *uptr);
+
+/* input file, either mapped to memory, or opened as a stdio stream */
+struct infile {
+	void *mem;
+	size_t size;
+	FILE *fp;
+};
+static int open_infile(struct infile *inf, const char *fname, const char *funcname);
+static void close_infile(struct infile *inf);
+
+static struct ts_node *load_text_inmem(void *data, size_t size, void (*release)(void*, size_t));
+static struct ts_node *load_whole_io(struct ts_io *io);
+static void free_data(void *data, size_t size);
+static void keep_data(void *data, size_t size);
+#ifdef USE_MMAP
+static void unmap_data(void *data, size_t size);
+#endif
+
 
 static enum ts_save_mode savemode;
 
@@ -59,33 +142,103 @@ enum ts_save_mode ts_get_save_mode(void)
 	return savemode;
 }
 
+static unsigned int loadflags;
+
+void ts_set_load_flags(unsigned int flags)
+{
+	loadflags = flags;
+}
+
+unsigned int ts_get_load_flags(void)
+{
+	return loadflags;
+}
+
 /* ---- ts_value implementation ---- */
 
+/* ts_value flags */
+#define VAL_INT		1	/* the number was set as an integer */
+#define VAL_INLINE	2	/* str is in the inline buffer */
+
+/* the longest "%d" or "%.9g" number, "-1.23456789e-38", fits in sbuf, so
+ * numbers are marked VAL_INLINE when set, and ts_get_value_str can format them
+ * without touching the flags
+ */
+#define NUM_FLAGS(isint)	((isint) ? VAL_INT | VAL_INLINE : VAL_INLINE)
+
 int ts_init_value(struct ts_value *tsv)
 {
 	memset(tsv, 0, sizeof *tsv);
 	return 0;
 }
 
+/* value buffers are allocated from the arena of the value, if it has one */
+static void *value_alloc(struct ts_value *tsv, size_t size)
+{
+	return tsv->arena ? ts_arena_alloc(tsv->arena, size) : malloc(size);
+}
+
+static void value_free(struct ts_value *tsv, void *ptr)
+{
+	if(!tsv->arena) {
+		free(ptr);
+	}
+}
+
+/* allocate space for a string of len characters (plus the terminator), using
+ * the inline buffer if it fits
+ */
+char *ts_alloc_value_str(struct ts_value *tsv, size_t len)
+{
+	if(len < sizeof tsv->sbuf) {
+		tsv->flags |= VAL_INLINE;
+		return tsv->sbuf;
+	}
+	tsv->flags &= ~VAL_INLINE;
+	return value_alloc(tsv, len + 1);
+}
+
+void ts_value_moved(struct ts_value *tsv)
+{
+	if(tsv->flags & VAL_INLINE) {
+		tsv->str = tsv->sbuf;
+	}
+}
+
+/* clear the value for reuse, without losing track of its arena */
+static void reset_value(struct ts_value *tsv)
+{
+	struct ts_arena *arena = tsv->arena;
+	ts_destroy_value(tsv);
+	ts_init_value(tsv);
+	tsv->arena = arena;
+}
+
 void ts_destroy_value(struct ts_value *tsv)
 {
 	int i;
 
-	free(tsv->str);
+	if(tsv->arena) return;	/* released with the arena */
+
+	if(!(tsv->flags & VAL_INLINE)) {
+		free(tsv->str);
+	}
 	free(tsv->vec);
 
-	for(i=0; i<tsv->array_size; i++) {
-		ts_destroy_value(tsv->array + i);
+	if(tsv->array) {
+		for(i=0; i<tsv->array_size; i++) {
+			ts_destroy_value(tsv->array + i);
+		}
+		free(tsv->array);
 	}
-	free(tsv->array);
 }
 
 
 struct ts_value *ts_alloc_value(void)
 {
-	struct ts_value *v = malloc(sizeof *v);
+	struct ts_value *v = ts_pool_alloc(TS_POOL_VALUE);
 	if(!v || ts_init_value(v) == -1) {
-		free(v);
+		if(v) ts_pool_free(TS_POOL_VALUE, v);
 		return 0;
 	}
 	return v;
@@ -94,13 +247,16 @@ struct ts_value *ts_alloc_value(void)
 void ts_free_value(struct ts_value *tsv)
 {
 	ts_destroy_value(tsv);
-	free(tsv);
+	if(!tsv->arena) {
+		ts_pool_free(TS_POOL_VALUE, tsv);
+	}
 }
 
 
 int ts_copy_value(struct ts_value *dest, struct ts_value *src)
 {
 	int i;
+	struct ts_arena *arena = dest->arena;
 
 	if(dest == src) return 0;
 
@@ -109,56 +265,115 @@ int ts_copy_value(struct ts_value *dest, struct ts_value *src)
 	dest->str = 0;
 	dest->vec = 0;
 	dest->array = 0;
+	dest->arena = arena;
+	dest->flags &= ~VAL_INLINE;
 
 	if(src->str) {
-		if(!(dest->str = malloc(strlen(src->str) + 1))) {
+		if(!(dest->str = ts_alloc_value_str(dest, strlen(src->str)))) {
 			goto fail;
 		}
 		strcpy(dest->str, src->str);
 	}
 	if(src->vec && src->vec_size > 0) {
-		if(!(dest->vec = malloc(src->vec_size * sizeof *src->vec))) {
+		if(!(dest->vec = value_alloc(dest, src->vec_size * sizeof *src->vec))) {
 			goto fail;
 		}
 		memcpy(dest->vec, src->vec, src->vec_size * sizeof *src->vec);
 	}
 	if(src->array && src->array_size > 0) {
-		if(!(dest->array = calloc(src->array_size, sizeof *src->array))) {
+		if(!(dest->array = value_alloc(dest, src->array_size * sizeof *src->array))) {
 			goto fail;
 		}
+		memset(dest->array, 0, src->array_size * sizeof *src->array);
 		for(i=0; i<src->array_size; i++) {
+			dest->array[i].arena = arena;
 			if(ts_copy_value(dest->array + i, src->array + i) == -1) {
 				goto fail;
 			}
 		}
 	}
+	if(dest->type == TS_NUMBER && !dest->str) {
+		dest->flags |= VAL_INLINE;
+	}
 	return 0;
 
 fail:
-	free(dest->str);
-	free(dest->vec);
+	if(!(dest->flags & VAL_INLINE)) {
+		value_free(dest, dest->str);
+	}
+	value_free(dest, dest->vec);
 	if(dest->array) {
 		for(i=0; i<dest->array_size; i++) {
 			ts_destroy_value(dest->array + i);
 		}
-		free(dest->array);
+		value_free(dest, dest->array);
 	}
 	return -1;
 }
 
-#define MAKE_NUMSTR_FUNC(type, fmt) \
-	static char *make_##type##str(type x) \
-	{ \
-		static char scrap[128]; \
-		char *str; \
-		int sz = snprintf(scrap, sizeof scrap, fmt, x); \
-		if(!(str = malloc(sz + 1))) return 0; \
-		sprintf(str, fmt, x); \
-		return str; \
+struct ts_value *ts_get_value_array(struct ts_value *tsv)
+{
+	int i;
+	struct ts_value *arr;
+
+	if(tsv->type != TS_VECTOR) {
+		return tsv->array;
+	}
+	if((arr = LOAD_PTR(tsv->array))) {
+		return arr;
+	}
+
+	CONV_LOCK();
+	if(!(arr = tsv->array)) {
+		if((arr = value_alloc(tsv, tsv->vec_size * sizeof *arr))) {
+			for(i=0; i<tsv->vec_size; i++) {
+				ts_init_value(arr + i);
+				arr[i].arena = tsv->arena;
+				ts_set_valuef(arr + i, tsv->vec[i]);
+			}
+			STORE_PTR(tsv->array, arr);
+		}
+	}
+	CONV_UNLOCK();
+	return arr;
+}
+
+const char *ts_get_value_str(struct ts_value *tsv)
+{
+	char buf[64];
+	char *str;
+
+	if(tsv->type != TS_NUMBER) {
+		return tsv->str;
+	}
+	if((str = LOAD_PTR(tsv->str))) {
+		return str;
+	}
+
+	/* numbers are formatted on demand, the same way the text writer does, and
+	 * always fit in the inline buffer (see NUM_FLAGS)
+	 */
+	if(tsv->flags & VAL_INT) {
+		sprintf(buf, "%d", tsv->inum);
+	} else {
+		sprintf(buf, "%.9g", tsv->fnum);
+	}
+
+	CONV_LOCK();
+	if(!(str = tsv->str)) {
+		strcpy(tsv->sbuf, buf);
+		STORE_PTR(tsv->str, tsv->sbuf);
+		str = tsv->sbuf;
 	}
+	CONV_UNLOCK();
+	return str;
+}
 
-MAKE_NUMSTR_FUNC(int, "%d")
-MAKE_NUMSTR_FUNC(float, "%g")
+/* used by the binary writer to store numbers in their original form */
+int ts_value_is_int(struct ts_value *tsv)
+{
+	return tsv->flags & VAL_INT;
+}
 
 
 struct val_list_node {
@@ -171,14 +386,11 @@ int ts_set_value_str(struct ts_value *tsv, const char *str)
 	if(!str) return -1;
 
 	if(tsv->str) {
-		ts_destroy_value(tsv);
-		if(ts_init_value(tsv) == -1) {
-			return -1;
-		}
+		reset_value(tsv);
 	}
 
 	tsv->type = TS_STRING;
-	if(!(tsv->str = malloc(strlen(str) + 1))) {
+	if(!(tsv->str = ts_alloc_value_str(tsv, strlen(str)))) {
 		return -1;
 	}
 	strcpy(tsv->str, str);
@@ -240,38 +452,29 @@ int ts_set_valuei_arr(struct ts_value *tsv, int count, const int *arr)
 
 	if(count < 1) return -1;
 	if(count == 1) {
-		if(!(tsv->str = make_intstr(*arr))) {
-			return -1;
+		if(tsv->str) {
+			reset_value(tsv);
 		}
 
 		tsv->type = TS_NUMBER;
 		tsv->fnum = (float)*arr;
 		tsv->inum = *arr;
+		tsv->flags |= NUM_FLAGS(1);
 		return 0;
 	}
 
-	/* otherwise it's an array, we need to create the ts_value array, and
-	 * the simplified vector
+	/* otherwise it's a vector, the ts_value array is created on demand by
+	 * ts_get_value_array
 	 */
-	if(!(tsv->vec = malloc(count * sizeof *tsv->vec))) {
+	if(!(tsv->vec = value_alloc(tsv, count * sizeof *tsv->vec))) {
 		return -1;
 	}
-	tsv->vec_size = count;
+	tsv->vec_size = tsv->array_size = count;
 
 	for(i=0; i<count; i++) {
 		tsv->vec[i] = arr[i];
 	}
 
-	if(!(tsv->array = malloc(count * sizeof *tsv->array))) {
-		free(tsv->vec);
-	}
-	tsv->array_size = count;
-
-	for(i=0; i<count; i++) {
-		ts_init_value(tsv->array + i);
-		ts_set_valuef(tsv->array + i, arr[i]);
-	}
-
 	tsv->type = TS_VECTOR;
 	return 0;
 }
@@ -309,44 +512,44 @@ int ts_set_valuei(struct ts_value *tsv, int inum)
 	return ts_set_valuei_arr(tsv, 1, &inum);
 }
 
+/* converting out of range floats to int is undefined, so clamp them */
+static int float_to_int(float x)
+{
+	if(x >= 2147483648.0f) return INT_MAX;
+	if(x < -2147483648.0f) return INT_MIN;
+	if(x != x) return 0;	/* NaN */
+	return (int)x;
+}
+
 int ts_set_valuef_arr(struct ts_value *tsv, int count, const float *arr)
 {
 	int i;
 
 	if(count < 1) return -1;
 	if(count == 1) {
-		if(!(tsv->str = make_floatstr(*arr))) {
-			return -1;
+		if(tsv->str) {
+			reset_value(tsv);
 		}
 
 		tsv->type = TS_NUMBER;
 		tsv->fnum = *arr;
-		tsv->inum = (int)*arr;
+		tsv->inum = float_to_int(*arr);
+		tsv->flags = (tsv->flags & ~VAL_INT) | NUM_FLAGS(0);
 		return 0;
 	}
 
-	/* otherwise it's an array, we need to create the ts_value array, and
-	 * the simplified vector
+	/* otherwise it's a vector, the ts_value array is created on demand by
+	 * ts_get_value_array
 	 */
-	if(!(tsv->vec = malloc(count * sizeof *tsv->vec))) {
+	if(!(tsv->vec = value_alloc(tsv, count * sizeof *tsv->vec))) {
 		return -1;
 	}
-	tsv->vec_size = count;
+	tsv->vec_size = tsv->array_size = count;
 
 	for(i=0; i<count; i++) {
 		tsv->vec[i] = arr[i];
 	}
 
-	if(!(tsv->array = malloc(count * sizeof *tsv->array))) {
-		free(tsv->vec);
-	}
-	tsv->array_size = count;
-
-	for(i=0; i<count; i++) {
-		ts_init_value(tsv->array + i);
-		ts_set_valuef(tsv->array + i, arr[i]);
-	}
-
 	tsv->type = TS_VECTOR;
 	return 0;
 }
@@ -391,39 +594,45 @@ int ts_set_value_arr(struct ts_value *tsv, int count, const struct ts_value *arr
 
 	if(count <= 1) return -1;
 
-	if(!(tsv->array = malloc(count * sizeof *tsv->array))) {
-		return -1;
-	}
-	tsv->array_size = count;
-
 	for(i=0; i<count; i++) {
 		if(arr[i].type != TS_NUMBER) {
 			allnum = 0;
-		}
-		if(ts_copy_value(tsv->array + i, (struct ts_value*)arr + i) == -1) {
-			while(--i >= 0) {
-				ts_destroy_value(tsv->array + i);
-			}
-			free(tsv->array);
-			tsv->array = 0;
-			return -1;
+			break;
 		}
 	}
 
 	if(allnum) {
-		if(!(tsv->vec = malloc(count * sizeof *tsv->vec))) {
-			ts_destroy_value(tsv);
+		/* all numbers, only the vector is needed */
+		if(!(tsv->vec = value_alloc(tsv, count * sizeof *tsv->vec))) {
 			return -1;
 		}
 		tsv->type = TS_VECTOR;
-		tsv->vec_size = count;
+		tsv->vec_size = tsv->array_size = count;
 
 		for(i=0; i<count; i++) {
-			tsv->vec[i] = tsv->array[i].fnum;
+			tsv->vec[i] = arr[i].fnum;
+		}
+		return 0;
+	}
+
+	if(!(tsv->array = value_alloc(tsv, count * sizeof *tsv->array))) {
+		return -1;
+	}
+	memset(tsv->array, 0, count * sizeof *tsv->array);
+	tsv->array_size = count;
+
+	for(i=0; i<count; i++) {
+		tsv->array[i].arena = tsv->arena;
+		if(ts_copy_value(tsv->array + i, (struct ts_value*)arr + i) == -1) {
+			while(--i >= 0) {
+				ts_destroy_value(tsv->array + i);
+			}
+			value_free(tsv, tsv->array);
+			tsv->array = 0;
+			return -1;
 		}
-	} else {
-		tsv->type = TS_ARRAY;
 	}
+	tsv->type = TS_ARRAY;
 	return 0;
 }
 
@@ -443,18 +652,20 @@ int ts_set_valuev_va(struct ts_value *tsv, int count, va_list ap)
 
 	if(count <= 1) return -1;
 
-	if(!(tsv->array = malloc(count * sizeof *tsv->array))) {
+	if(!(tsv->array = value_alloc(tsv, count * sizeof *tsv->array))) {
 		return -1;
 	}
+	memset(tsv->array, 0, count * sizeof *tsv->array);
 	tsv->array_size = count;
 
 	for(i=0; i<count; i++) {
 		struct ts_value *src = va_arg(ap, struct ts_value*);
+		tsv->array[i].arena = tsv->arena;
 		if(ts_copy_value(tsv->array + i, src) == -1) {
 			while(--i >= 0) {
 				ts_destroy_value(tsv->array + i);
 			}
-			free(tsv->array);
+			value_free(tsv, tsv->array);
 			tsv->array = 0;
 			return -1;
 		}
@@ -473,15 +684,17 @@ int ts_init_attr(struct ts_attr *attr)
 
 void ts_destroy_attr(struct ts_attr *attr)
 {
-	free(attr->name);
+	if(!attr->name_atom && !attr->arena) {
+		free(attr->name);
+	}
 	ts_destroy_value(&attr->val);
 }
 
 struct ts_attr *ts_alloc_attr(void)
 {
-	struct ts_attr *attr = malloc(sizeof *attr);
+	struct ts_attr *attr = ts_pool_alloc(TS_POOL_ATTR);
 	if(!attr || ts_init_attr(attr) == -1) {
-		free(attr);
+		if(attr) ts_pool_free(TS_POOL_ATTR, attr);
 		return 0;
 	}
 	return attr;
@@ -490,7 +703,9 @@ struct ts_attr *ts_alloc_attr(void)
 void ts_free_attr(struct ts_attr *attr)
 {
 	ts_destroy_attr(attr);
-	free(attr);
+	if(!attr->arena) {
+		ts_pool_free(TS_POOL_ATTR, attr);
+	}
 }
 
 int ts_copy_attr(struct ts_attr *dest, struct ts_attr *src)
@@ -510,12 +725,26 @@ int ts_copy_attr(struct ts_attr *dest, struct ts_attr *src)
 
 int ts_set_attr_name(struct ts_attr *attr, const char *name)
 {
-	char *n = malloc(strlen(name) + 1);
-	if(!n) return -1;
-	strcpy(n, name);
+	const char *n;
+	long len = strlen(name);
+	int atom = ts_intern_len(name, len, ts_intern_hash(name, len), &n);
+	if(atom == -1) return -1;
+	if(!atom && !(n = ts_name_copy(attr->arena, name, len))) {
+		return -1;
+	}
+
+	if(!attr->name_atom && !attr->arena) {
+		free(attr->name);
+	}
+	attr->name = (char*)n;
+	attr->name_atom = atom;
 
-	free(attr->name);
-	attr->name = n;
+	if(attr->parent) {
+		if(attr->parent->attr_index) {
+			build_attr_index(attr->parent);
+		}
+		touch_node(attr->parent);
+	}
 	return 0;
 }
 
@@ -532,20 +761,41 @@ void ts_destroy_node(struct ts_node *node)
 {
 	if(!node) return;
 
-	free(node->name);
+	if(!node->name_atom && !node->arena) {
+		free(node->name);
+	}
+
+	if(node->lazy) {
+		ts_text_free_lazy(node->lazy);
+		node->lazy = 0;
+		if(node->arena) {
+			node->arena->owner->nforeign--;
+		}
+	}
+	if(node->lcache) {
+		free_lcache(node);
+		if(node->arena) {
+			node->arena->owner->nforeign--;
+		}
+	}
 
 	while(node->attr_list) {
 		struct ts_attr *attr = node->attr_list;
 		node->attr_list = node->attr_list->next;
+		if(node->arena && ARENA_OWNER(attr->arena) != node->arena->owner) {
+			node->arena->owner->nforeign--;
+		}
 		ts_free_attr(attr);
 	}
+	drop_attr_index(node);
+	drop_child_index(node);
 }
 
 struct ts_node *ts_alloc_node(void)
 {
-	struct ts_node *node = malloc(sizeof *node);
+	struct ts_node *node = ts_pool_alloc(TS_POOL_NODE);
 	if(!node || ts_init_node(node) == -1) {
-		free(node);
+		if(node) ts_pool_free(TS_POOL_NODE, node);
 		return 0;
 	}
 	return node;
@@ -554,13 +804,67 @@ struct ts_node *ts_alloc_node(void)
 void ts_free_node(struct ts_node *node)
 {
 	ts_destroy_node(node);
-	free(node);
+	if(node && !node->arena) {
+		ts_pool_free(TS_POOL_NODE, node);
+	}
+}
+
+/* free everything hanging off an arena subtree, which isn't in the arena */
+static void free_foreign(struct ts_node *node, struct ts_arena *owner)
+{
+	struct ts_attr *attr;
+	struct ts_node *c, *next;
+
+	if(node->lazy) {
+		ts_text_free_lazy(node->lazy);
+		node->lazy = 0;
+		owner->nforeign--;
+	}
+	if(node->lcache) {
+		free_lcache(node);
+		owner->nforeign--;
+	}
+
+	attr = node->attr_list;
+	while(attr && owner->nforeign > 0) {
+		struct ts_attr *anext = attr->next;
+		if(ARENA_OWNER(attr->arena) != owner) {
+			ts_free_attr(attr);
+			owner->nforeign--;
+		}
+		attr = anext;
+	}
+
+	c = node->child_list;
+	while(c && owner->nforeign > 0) {
+		next = c->next;
+		if(ARENA_OWNER(c->arena) != owner) {
+			ts_free_tree(c);
+			owner->nforeign--;
+		} else {
+			free_foreign(c, owner);
+		}
+		c = next;
+	}
 }
 
 void ts_free_tree(struct ts_node *tree)
 {
+	struct ts_arena *owner;
+
 	if(!tree) return;
 
+	if(tree->arena) {
+		owner = tree->arena->owner;
+		if(owner->nforeign > 0) {
+			free_foreign(tree, owner);
+		}
+		if(owner->root == tree) {
+			ts_arena_destroy(owner);
+		}
+		return;
+	}
+
 	while(tree->child_list) {
 		struct ts_node *child = tree->child_list;
 		tree->child_list = tree->child_list->next;
@@ -572,115 +876,566 @@ void ts_free_tree(struct ts_node *tree)
 
 int ts_set_node_name(struct ts_node *node, const char *name)
 {
-	char *n = malloc(strlen(name) + 1);
-	if(!n) return -1;
-	strcpy(n, name);
+	const char *n;
+	long len = strlen(name);
+	int atom = ts_intern_len(name, len, ts_intern_hash(name, len), &n);
+	if(atom == -1) return -1;
+	if(!atom && !(n = ts_name_copy(node->arena, name, len))) {
+		return -1;
+	}
 
-	free(node->name);
-	node->name = n;
+	if(!node->name_atom && !node->arena) {
+		free(node->name);
+	}
+	node->name = (char*)n;
+	node->name_atom = atom;
+
+	if(node->parent && node->parent->child_index) {
+		build_child_index(node->parent);
+	}
+	touch_node(node);
 	return 0;
 }
 
-void ts_add_attr(struct ts_node *node, struct ts_attr *attr)
+struct ts_node *ts_alloc_arena_tree(void)
 {
-	attr->next = 0;
-	if(node->attr_list) {
-		node->attr_tail->next = attr;
-		node->attr_tail = attr;
-	} else {
-		node->attr_list = node->attr_tail = attr;
+	struct ts_arena *arena;
+	struct ts_node *root;
+
+	if(!(arena = ts_arena_create(0))) {
+		return 0;
 	}
-	node->attr_count++;
+	if(!(root = ts_arena_alloc(arena, sizeof *root))) {
+		ts_arena_destroy(arena);
+		return 0;
+	}
+	ts_init_node(root);
+	root->arena = arena;
+	arena->root = root;
+	return root;
 }
 
-struct ts_attr *ts_get_attr(struct ts_node *node, const char *name)
+struct ts_node *ts_alloc_node_from(struct ts_node *tree)
 {
-	struct ts_attr *attr = node->attr_list;
-	while(attr) {
-		if(strcmp(attr->name, name) == 0) {
-			return attr;
-		}
-		attr = attr->next;
-	}
-	return 0;
+	return ts_alloc_node_arena(tree->arena);
 }
 
-const char *ts_get_attr_str(struct ts_node *node, const char *aname, const char *def_val)
+struct ts_attr *ts_alloc_attr_from(struct ts_node *tree)
 {
-	struct ts_attr *attr = ts_get_attr(node, aname);
-	if(!attr || !attr->val.str) {
-		return def_val;
-	}
-	return attr->val.str;
+	return ts_alloc_attr_arena(tree->arena);
 }
 
-float ts_get_attr_num(struct ts_node *node, const char *aname, float def_val)
+/* used by the parser, which allocates straight from its own arena */
+struct ts_node *ts_alloc_node_arena(struct ts_arena *arena)
 {
-	struct ts_attr *attr = ts_get_attr(node, aname);
-	if(!attr || attr->val.type != TS_NUMBER) {
-		return def_val;
+	struct ts_node *node;
+
+	if(!arena) {
+		return ts_alloc_node();
 	}
-	return attr->val.fnum;
+	if(!(node = ts_arena_alloc(arena, sizeof *node))) {
+		return 0;
+	}
+	ts_init_node(node);
+	node->arena = arena;
+	return node;
 }
 
-int ts_get_attr_int(struct ts_node *node, const char *aname, int def_val)
+struct ts_attr *ts_alloc_attr_arena(struct ts_arena *arena)
 {
-	struct ts_attr *attr = ts_get_attr(node, aname);
-	if(!attr || attr->val.type != TS_NUMBER) {
-		return def_val;
+	struct ts_attr *attr;
+
+	if(!arena) {
+		return ts_alloc_attr();
 	}
-	return attr->val.inum;
+	if(!(attr = ts_arena_alloc(arena, sizeof *attr))) {
+		return 0;
+	}
+	ts_init_attr(attr);
+	attr->arena = attr->val.arena = arena;
+	return attr;
 }
 
-float *ts_get_attr_vec(struct ts_node *node, const char *aname, float *def_val)
+int ts_expand_node(struct ts_node *node)
 {
-	struct ts_attr *attr = ts_get_attr(node, aname);
-	if(!attr || !attr->val.vec) {
-		return def_val;
+	if(!node->lazy) return 0;
+	return ts_text_expand(node);
+}
+
+int ts_expand_tree(struct ts_node *tree)
+{
+	int res;
+	struct ts_node *c;
+
+	res = ts_expand_node(tree);
+
+	c = tree->child_list;
+	while(c) {
+		if(ts_expand_tree(c) == -1) {
+			res = -1;
+		}
+		c = c->next;
 	}
-	return attr->val.vec;
+	return res;
 }
 
-struct ts_value *ts_get_attr_array(struct ts_node *node, const char *aname, struct ts_value *def_val)
+/* Name indexes: nodes with many attributes or children keep open addressing
+ * hash tables (with linear probing) of their names, built once they have
+ * NAME_INDEX_MIN of either. Each slot holds the first attribute or child with a
+ * name, since that's the one ts_get_attr/ts_get_child returns. Children with
+ * the same name are also chained in order through next_dup. The indexes of
+ * arena nodes are allocated from the arena.
+ */
+#define NAME_INDEX_MIN	16
+
+struct name_slot {
+	unsigned int hash;
+	const char *name;
+	void *first, *last;	/* attribute indexes only use first */
+};
+
+struct ts_name_index {
+	int size, count;	/* size is a power of two */
+	struct name_slot *slot;
+};
+
+/* names are null until set */
+#define NAME(s)	((s) ? (s) : "")
+
+static unsigned int name_hash(const char *name)
 {
-	struct ts_attr *attr = ts_get_attr(node, aname);
-	if(!attr || !attr->val.array) {
-		return def_val;
+	return ts_intern_hash(name, strlen(name));
+}
+
+static struct ts_name_index *alloc_index(struct ts_node *node, int size)
+{
+	struct ts_name_index *idx;
+	size_t sz = sizeof *idx + size * sizeof *idx->slot;
+
+	if(!(idx = node->arena ? ts_arena_alloc(node->arena, sz) : malloc(sz))) {
+		return 0;
 	}
-	return attr->val.array;
+	idx->size = size;
+	idx->count = 0;
+	idx->slot = (struct name_slot*)(idx + 1);
+	memset(idx->slot, 0, size * sizeof *idx->slot);
+	return idx;
 }
 
-void ts_add_child(struct ts_node *node, struct ts_node *child)
+static void free_index(struct ts_node *node, struct ts_name_index *idx)
 {
-	if(child->parent) {
-		if(child->parent == node) return;
-		ts_remove_child(child->parent, child);
+	if(!node->arena) {
+		free(idx);
 	}
-	child->parent = node;
-	child->next = 0;
+}
 
-	if(node->child_list) {
-		node->child_tail->next = child;
-		node->child_tail = child;
-	} else {
-		node->child_list = node->child_tail = child;
+/* returns the slot of name, or the empty slot where it goes */
+static struct name_slot *index_find(struct ts_name_index *idx, const char *name, unsigned int hash)
+{
+	struct name_slot *s;
+	int i = hash & (idx->size - 1);
+
+	while((s = idx->slot + i)->first) {
+		if(s->hash == hash && (s->name == name || strcmp(s->name, name) == 0)) {
+			break;
+		}
+		i = (i + 1) & (idx->size - 1);
 	}
-	node->child_count++;
+	return s;
 }
 
-int ts_remove_child(struct ts_node *node, struct ts_node *child)
+static void *index_lookup(struct ts_name_index *idx, const char *name)
 {
-	struct ts_node dummy, *iter = &dummy;
-	dummy.next = node->child_list;
+	return index_find(idx, name, name_hash(name))->first;
+}
 
-	while(iter->next && iter->next != child) {
-		iter = iter->next;
+/* make room for one more name, doubling the table if it gets half full */
+static int index_reserve(struct ts_node *node, struct ts_name_index **idxp)
+{
+	int i;
+	struct ts_name_index *idx = *idxp, *newidx;
+
+	if((idx->count + 1) * 2 <= idx->size) {
+		return 0;
 	}
-	if(!iter->next) {
+	if(!(newidx = alloc_index(node, idx->size * 2))) {
 		return -1;
 	}
+	for(i=0; i<idx->size; i++) {
+		if(idx->slot[i].first) {
+			*index_find(newidx, idx->slot[i].name, idx->slot[i].hash) = idx->slot[i];
+		}
+	}
+	newidx->count = idx->count;
+	free_index(node, idx);
+	*idxp = newidx;
+	return 0;
+}
+
+/* empty a slot, moving back any following entries which would otherwise become
+ * unreachable, so that no tombstones are needed
+ */
+static void index_remove(struct ts_name_index *idx, struct name_slot *s)
+{
+	int mask = idx->size - 1;
+	int i = s - idx->slot, j = i, home;
+
+	for(;;) {
+		j = (j + 1) & mask;
+		if(!idx->slot[j].first) break;
+
+		/* entries with their home slot cyclically in (i, j] stay put */
+		home = idx->slot[j].hash & mask;
+		if(i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+			continue;
+		}
+		idx->slot[i] = idx->slot[j];
+		i = j;
+	}
+	idx->slot[i].first = 0;
+	idx->count--;
+}
+
+static void drop_attr_index(struct ts_node *node)
+{
+	free_index(node, node->attr_index);
+	node->attr_index = 0;
+}
+
+static void drop_child_index(struct ts_node *node)
+{
+	free_index(node, node->child_index);
+	node->child_index = 0;
+}
+
+/* failing to grow an index drops it, and lookups fall back to walking the list */
+static void index_attr(struct ts_node *node, struct ts_attr *attr)
+{
+	struct name_slot *s;
+	const char *name = NAME(attr->name);
+	unsigned int hash = name_hash(name);
+
+	if(index_reserve(node, &node->attr_index) == -1) {
+		drop_attr_index(node);
+		return;
+	}
+	s = index_find(node->attr_index, name, hash);
+	if(!s->first) {
+		s->hash = hash;
+		s->name = name;
+		s->first = attr;
+		node->attr_index->count++;
+	}
+}
+
+static void index_child(struct ts_node *node, struct ts_node *child)
+{
+	struct name_slot *s;
+	const char *name = NAME(child->name);
+	unsigned int hash = name_hash(name);
+
+	if(index_reserve(node, &node->child_index) == -1) {
+		drop_child_index(node);
+		return;
+	}
+	child->next_dup = 0;
+	s = index_find(node->child_index, name, hash);
+	if(s->first) {
+		((struct ts_node*)s->last)->next_dup = child;
+	} else {
+		s->hash = hash;
+		s->name = name;
+		s->first = child;
+		node->child_index->count++;
+	}
+	s->last = child;
+}
+
+static void unindex_attr(struct ts_node *node, struct ts_attr *attr)
+{
+	struct ts_attr *dup;
+	const char *name = NAME(attr->name);
+	struct name_slot *s = index_find(node->attr_index, name, name_hash(name));
+
+	if(s->first != attr) return;
+	index_remove(node->attr_index, s);
+
+	/* the next attribute with the same name takes its place */
+	dup = attr->next;
+	while(dup && strcmp(NAME(dup->name), name) != 0) {
+		dup = dup->next;
+	}
+	if(dup) {
+		index_attr(node, dup);
+	}
+}
+
+static void unindex_child(struct ts_node *node, struct ts_node *child)
+{
+	struct ts_node *prev;
+	const char *name = NAME(child->name);
+	struct name_slot *s = index_find(node->child_index, name, name_hash(name));
+
+	if(s->first == child) {
+		if((prev = child->next_dup)) {
+			s->first = prev;
+			s->name = NAME(prev->name);
+		} else {
+			index_remove(node->child_index, s);
+		}
+		return;
+	}
+
+	prev = s->first;
+	while(prev && prev->next_dup != child) {
+		prev = prev->next_dup;
+	}
+	if(prev) {
+		prev->next_dup = child->next_dup;
+		if(s->last == child) {
+			s->last = prev;
+		}
+	}
+}
+
+static void build_attr_index(struct ts_node *node)
+{
+	struct ts_attr *attr;
+
+	drop_attr_index(node);
+	if(!(node->attr_index = alloc_index(node, NAME_INDEX_MIN * 4))) {
+		return;
+	}
+	attr = node->attr_list;
+	while(attr && node->attr_index) {
+		index_attr(node, attr);
+		attr = attr->next;
+	}
+}
+
+static void build_child_index(struct ts_node *node)
+{
+	struct ts_node *c;
+
+	drop_child_index(node);
+	if(!(node->child_index = alloc_index(node, NAME_INDEX_MIN * 4))) {
+		return;
+	}
+	c = node->child_list;
+	while(c && node->child_index) {
+		index_child(node, c);
+		c = c->next;
+	}
+}
+
+void ts_add_attr(struct ts_node *node, struct ts_attr *attr)
+{
+	if(node->lazy) ts_expand_node(node);
+
+	if(attr->parent) {
+		if(attr->parent == node) return;
+		ts_remove_attr(attr->parent, attr);
+	}
+	attr->parent = node;
+
+	if(node->arena && ARENA_OWNER(attr->arena) != node->arena->owner) {
+		node->arena->owner->nforeign++;
+	}
+
+	attr->next = 0;
+	if(node->attr_list) {
+		node->attr_tail->next = attr;
+		node->attr_tail = attr;
+	} else {
+		node->attr_list = node->attr_tail = attr;
+	}
+	node->attr_count++;
+
+	if(node->attr_index) {
+		index_attr(node, attr);
+	} else if(node->attr_count >= NAME_INDEX_MIN) {
+		build_attr_index(node);
+	}
+	touch_node(node);
+}
+
+int ts_remove_attr(struct ts_node *node, struct ts_attr *attr)
+{
+	struct ts_attr dummy, *iter = &dummy;
+	dummy.next = node->attr_list;
+
+	while(iter->next && iter->next != attr) {
+		iter = iter->next;
+	}
+	if(!iter->next) {
+		return -1;
+	}
+
+	if(node->attr_index) {
+		unindex_attr(node, attr);
+	}
+
+	attr->parent = 0;
+	if(node->arena && ARENA_OWNER(attr->arena) != node->arena->owner) {
+		node->arena->owner->nforeign--;
+	}
+
+	iter->next = attr->next;
+	if(!iter->next) {
+		node->attr_tail = iter == &dummy ? 0 : iter;
+	}
+	node->attr_list = dummy.next;
+	node->attr_count--;
+	assert(node->attr_count >= 0);
+	touch_node(node);
+	return 0;
+}
+
+struct ts_attr *ts_get_attr(struct ts_node *node, const char *name)
+{
+	struct ts_attr *attr;
+
+	if(node->lazy) ts_expand_node(node);
+
+	if(node->attr_index) {
+		return index_lookup(node->attr_index, name);
+	}
+
+	attr = node->attr_list;
+	while(attr) {
+		if(strcmp(attr->name, name) == 0) {
+			return attr;
+		}
+		attr = attr->next;
+	}
+	return 0;
+}
+
+struct ts_attr *ts_get_attr_atom(struct ts_node *node, int atom)
+{
+	struct ts_attr *attr;
+	const char *name;
+
+	if(atom <= 0) return 0;	/* un-interned names can't be looked up by atom */
+	if(node->lazy) ts_expand_node(node);
+
+	if(node->attr_index) {
+		if(!(name = ts_atom_name(atom))) {
+			return 0;
+		}
+		return index_lookup(node->attr_index, name);
+	}
+
+	attr = node->attr_list;
+	while(attr) {
+		if(attr->name_atom == atom) {
+			return attr;
+		}
+		attr = attr->next;
+	}
+	return 0;
+}
+
+const char *ts_get_attr_str(struct ts_node *node, const char *aname, const char *def_val)
+{
+	struct ts_attr *attr = ts_get_attr(node, aname);
+	const char *str;
+
+	if(!attr || !(str = ts_get_value_str(&attr->val))) {
+		return def_val;
+	}
+	return str;
+}
+
+float ts_get_attr_num(struct ts_node *node, const char *aname, float def_val)
+{
+	struct ts_attr *attr = ts_get_attr(node, aname);
+	if(!attr || attr->val.type != TS_NUMBER) {
+		return def_val;
+	}
+	return attr->val.fnum;
+}
+
+int ts_get_attr_int(struct ts_node *node, const char *aname, int def_val)
+{
+	struct ts_attr *attr = ts_get_attr(node, aname);
+	if(!attr || attr->val.type != TS_NUMBER) {
+		return def_val;
+	}
+	return attr->val.inum;
+}
+
+float *ts_get_attr_vec(struct ts_node *node, const char *aname, float *def_val)
+{
+	struct ts_attr *attr = ts_get_attr(node, aname);
+	if(!attr || !attr->val.vec) {
+		return def_val;
+	}
+	return attr->val.vec;
+}
+
+struct ts_value *ts_get_attr_array(struct ts_node *node, const char *aname, struct ts_value *def_val)
+{
+	struct ts_attr *attr = ts_get_attr(node, aname);
+	struct ts_value *arr;
+
+	if(!attr || !(arr = ts_get_value_array(&attr->val))) {
+		return def_val;
+	}
+	return arr;
+}
+
+void ts_add_child(struct ts_node *node, struct ts_node *child)
+{
+	if(node->lazy) ts_expand_node(node);
 
+	if(child->parent) {
+		if(child->parent == node) return;
+		ts_remove_child(child->parent, child);
+	}
+	child->parent = node;
+	child->next = 0;
+
+	if(node->arena && ARENA_OWNER(child->arena) != node->arena->owner) {
+		node->arena->owner->nforeign++;
+	}
+
+	if(node->child_list) {
+		node->child_tail->next = child;
+		node->child_tail = child;
+	} else {
+		node->child_list = node->child_tail = child;
+	}
+	node->child_count++;
+
+	if(node->child_index) {
+		index_child(node, child);
+	} else if(node->child_count >= NAME_INDEX_MIN) {
+		build_child_index(node);
+	}
+	touch_node(node);
+}
+
+int ts_remove_child(struct ts_node *node, struct ts_node *child)
+{
+	struct ts_node dummy, *iter = &dummy;
+	dummy.next = node->child_list;
+
+	while(iter->next && iter->next != child) {
+		iter = iter->next;
+	}
+	if(!iter->next) {
+		return -1;
+	}
+
+	if(node->child_index) {
+		unindex_child(node, child);
+	}
 	child->parent = 0;
+	child->next_dup = 0;
+	if(node->arena && ARENA_OWNER(child->arena) != node->arena->owner) {
+		node->arena->owner->nforeign--;
+	}
 
 	iter->next = child->next;
 	if(!iter->next) {
@@ -689,12 +1444,21 @@ int ts_remove_child(struct ts_node *node, struct ts_node *child)
 	node->child_list = dummy.next;
 	node->child_count--;
 	assert(node->child_count >= 0);
+	touch_node(node);
 	return 0;
 }
 
 struct ts_node *ts_get_child(struct ts_node *node, const char *name)
 {
-	struct ts_node *res = node->child_list;
+	struct ts_node *res;
+
+	if(node->lazy) ts_expand_node(node);
+
+	if(node->child_index) {
+		return index_lookup(node->child_index, name);
+	}
+
+	res = node->child_list;
 	while(res) {
 		if(strcmp(res->name, name) == 0) {
 			return res;
@@ -704,21 +1468,113 @@ struct ts_node *ts_get_child(struct ts_node *node, const char *name)
 	return 0;
 }
 
+struct ts_node *ts_get_child_atom(struct ts_node *node, int atom)
+{
+	struct ts_node *res;
+	const char *name;
+
+	if(atom <= 0) return 0;
+	if(node->lazy) ts_expand_node(node);
+
+	if(node->child_index) {
+		if(!(name = ts_atom_name(atom))) {
+			return 0;
+		}
+		return index_lookup(node->child_index, name);
+	}
+
+	res = node->child_list;
+	while(res) {
+		if(res->name_atom == atom) {
+			return res;
+		}
+		res = res->next;
+	}
+	return 0;
+}
+
+struct ts_node *ts_get_next_child(struct ts_node *child)
+{
+	struct ts_node *res;
+
+	if(!child->parent) return 0;
+
+	if(child->parent->child_index) {
+		return child->next_dup;
+	}
+
+	res = child->next;
+	while(res) {
+		if(res->name == child->name || strcmp(NAME(res->name), NAME(child->name)) == 0) {
+			return res;
+		}
+		res = res->next;
+	}
+	return 0;
+}
+
+struct ts_attr *ts_get_attr_list(struct ts_node *node)
+{
+	if(node->lazy) ts_expand_node(node);
+	return node->attr_list;
+}
+
+struct ts_node *ts_get_child_list(struct ts_node *node)
+{
+	if(node->lazy) ts_expand_node(node);
+	return node->child_list;
+}
+
 struct ts_node *ts_load(const char *fname)
 {
-	FILE *fp;
+	struct infile inf;
 	struct ts_node *root;
 
-	if(!(fp = fopen(fname, "rb"))) {
-		fprintf(stderr, "ts_load: failed to open file: %s: %s\n", fname, strerror(errno));
+	if(open_infile(&inf, fname, "ts_load") == -1) {
 		return 0;
 	}
-
-	root = ts_load_file(fp);
-	fclose(fp);
+#ifdef USE_MMAP
+	/* a parallel load is done with the input when it returns, so the mapping
+	 * can be handed over to it. A lazy load keeps referring to the input, and
+	 * if it kept the file mapped, truncating the file later would crash node
+	 * expansion with SIGBUS, so ts_load_mem makes a copy instead.
+	 */
+	if(inf.mem && (loadflags & (TS_LOAD_LAZY | TS_LOAD_PARALLEL)) == TS_LOAD_PARALLEL &&
+			!ts_bin_check(inf.mem, inf.size)) {
+		return load_text_inmem(inf.mem, inf.size, unmap_data);
+	}
+#endif
+	if(inf.mem) {
+		root = ts_load_mem(inf.mem, inf.size);
+	} else {
+		root = ts_load_file(inf.fp);
+	}
+	close_infile(&inf);
 	return root;
 }
 
+struct ts_node *ts_load_mem(const void *buf, size_t len)
+{
+	if(ts_bin_check(buf, len)) {
+		return ts_bin_load_mem(buf, len);
+	}
+
+	if(loadflags & TS_LOAD_LAZY) {
+		/* unexpanded nodes refer back to the input, so we need our own copy */
+		char *copy;
+		if(!(copy = malloc(len + 1))) {
+			perror("ts_load_mem: failed to allocate input buffer");
+			return 0;
+		}
+		memcpy(copy, buf, len);
+		return ts_text_load_lazy(copy, len, free_data);
+	}
+	if(loadflags & TS_LOAD_PARALLEL) {
+		return ts_text_load_parallel((void*)buf, len, keep_data);
+	}
+	return ts_text_load_mem(buf, len);
+}
+
 struct ts_node *ts_load_file(FILE *fp)
 {
 	struct ts_io io = {0};
@@ -730,11 +1586,28 @@ struct ts_node *ts_load_file(FILE *fp)
 
 struct ts_node *ts_load_io(struct ts_io *io)
 {
-	struct ts_node *n;
-	if((n = ts_bin_load(io))) {
-		return n;
+	long sz;
+	struct peekio pk;
+	struct ts_io pkio = {0};
+
+	pk.io = io;
+	pk.len = pk.pos = 0;
+	while(pk.len < PEEK_SIZE) {
+		if((sz = io->read(pk.buf + pk.len, PEEK_SIZE - pk.len, io->data)) <= 0) {
+			break;
+		}
+		pk.len += sz;
+	}
+	pkio.data = &pk;
+	pkio.read = peekio_read;
+
+	if(ts_bin_check(pk.buf, pk.len)) {
+		return ts_bin_load(&pkio);
 	}
-	return ts_text_load(io);
+	if(loadflags & (TS_LOAD_LAZY | TS_LOAD_PARALLEL)) {
+		return load_whole_io(&pkio);
+	}
+	return ts_text_load(&pkio);
 }
 
 int ts_save(struct ts_node *tree, const char *fname)
@@ -768,6 +1641,42 @@ int ts_save_io(struct ts_node *tree, struct ts_io *io)
 	return ts_text_save(tree, io);
 }
 
+int ts_parse(const char *fname, struct ts_parse_callbacks *cb)
+{
+	struct infile inf;
+	int res;
+
+	if(open_infile(&inf, fname, "ts_parse") == -1) {
+		return -1;
+	}
+	if(inf.mem) {
+		res = ts_parse_mem(inf.mem, inf.size, cb);
+	} else {
+		res = ts_parse_file(inf.fp, cb);
+	}
+	close_infile(&inf);
+	return res;
+}
+
+int ts_parse_file(FILE *fp, struct ts_parse_callbacks *cb)
+{
+	struct ts_io io = {0};
+	io.data = fp;
+	io.read = io_read;
+
+	return ts_parse_io(&io, cb);
+}
+
+int ts_parse_io(struct ts_io *io, struct ts_parse_callbacks *cb)
+{
+	return ts_text_parse(io, cb);
+}
+
+int ts_parse_mem(const void *buf, size_t len, struct ts_parse_callbacks *cb)
+{
+	return ts_text_parse_mem(buf, len, cb);
+}
+
 static const char *pathtok(const char *path, char *tok)
 {
 	int len;
@@ -783,12 +1692,10 @@ static const char *pathtok(const char *path, char *tok)
 	return dot + 1;
 }
 
-struct ts_attr *ts_lookup(struct ts_node *node, const char *path)
+static struct ts_attr *lookup_path(struct ts_node *node, const char *path)
 {
 	char *name = alloca(strlen(path) + 1);
 
-	if(!node) return 0;
-
 	if(!(path = pathtok(path, name)) || strcmp(name, node->name) != 0) {
 		return 0;
 	}
@@ -799,13 +1706,157 @@ struct ts_attr *ts_lookup(struct ts_node *node, const char *path)
 	return ts_get_attr(node, name);
 }
 
+/* Lookup cache: a hash table of paths with a short probe sequence, where the
+ * home slot is evicted if there's no room. Entries are only valid while the
+ * generation they were stored with is current. Structural changes bump the
+ * generation of every cache on the way up to the root, but only while caches
+ * exist at all.
+ */
+#define LCACHE_PROBES	4
+
+struct lcache_entry {
+	char *path;
+	unsigned int hash;
+	unsigned long gen;
+	struct ts_attr *attr;	/* null for failed lookups */
+};
+
+struct ts_lookup_cache {
+	int size;	/* power of two */
+	unsigned long gen;
+	struct lcache_entry *ent;
+};
+
+static int num_lcaches;
+
+#ifdef __GNUC__
+#define LCACHE_COUNT(x)	__sync_fetch_and_add(&num_lcaches, x)
+#else
+#define LCACHE_COUNT(x)	(num_lcaches += (x))
+#endif
+
+int ts_set_lookup_cache(struct ts_node *root, int size)
+{
+	struct ts_lookup_cache *lc;
+	int n = 1;
+
+	if(root->lcache) {
+		free_lcache(root);
+		if(root->arena) {
+			root->arena->owner->nforeign--;
+		}
+	}
+	if(size <= 0) {
+		return 0;
+	}
+
+	while(n < size) n <<= 1;
+
+	if(!(lc = malloc(sizeof *lc + n * sizeof *lc->ent))) {
+		return -1;
+	}
+	lc->size = n;
+	lc->gen = 1;
+	lc->ent = (struct lcache_entry*)(lc + 1);
+	memset(lc->ent, 0, n * sizeof *lc->ent);
+
+	root->lcache = lc;
+	if(root->arena) {
+		root->arena->owner->nforeign++;
+	}
+	LCACHE_COUNT(1);
+	return 0;
+}
+
+static void free_lcache(struct ts_node *node)
+{
+	int i;
+	struct ts_lookup_cache *lc = node->lcache;
+
+	for(i=0; i<lc->size; i++) {
+		free(lc->ent[i].path);
+	}
+	free(lc);
+	node->lcache = 0;
+	LCACHE_COUNT(-1);
+}
+
+static void touch_node(struct ts_node *node)
+{
+	if(!num_lcaches) return;
+
+	while(node) {
+		if(node->lcache) {
+			node->lcache->gen++;
+		}
+		node = node->parent;
+	}
+}
+
+static struct ts_attr *cached_lookup(struct ts_node *root, const char *path)
+{
+	int i;
+	struct ts_lookup_cache *lc = root->lcache;
+	struct lcache_entry *e, *slot = 0;
+	struct ts_attr *attr;
+	size_t len = strlen(path);
+	unsigned int hash = ts_intern_hash(path, len);
+
+	for(i=0; i<LCACHE_PROBES; i++) {
+		e = lc->ent + ((hash + i) & (lc->size - 1));
+		if(!e->path) {
+			if(!slot) slot = e;
+			break;	/* entries are never removed, so it can't be further on */
+		}
+		if(e->hash == hash && strcmp(e->path, path) == 0) {
+			if(e->gen == lc->gen) {
+				return e->attr;
+			}
+			slot = e;
+			break;
+		}
+		if(!slot && e->gen != lc->gen) {
+			slot = e;	/* stale entries can be replaced */
+		}
+	}
+
+	attr = lookup_path(root, path);
+
+	if(!slot) {
+		slot = lc->ent + (hash & (lc->size - 1));
+	}
+	if(!slot->path || slot->hash != hash || strcmp(slot->path, path) != 0) {
+		free(slot->path);
+		if(!(slot->path = malloc(len + 1))) {
+			return attr;
+		}
+		memcpy(slot->path, path, len + 1);
+		slot->hash = hash;
+	}
+	slot->attr = attr;
+	slot->gen = lc->gen;	/* after lookup_path, which may have expanded nodes */
+	return attr;
+}
+
+struct ts_attr *ts_lookup(struct ts_node *node, const char *path)
+{
+	if(!node) return 0;
+
+	if(node->lcache) {
+		return cached_lookup(node, path);
+	}
+	return lookup_path(node, path);
+}
+
 const char *ts_lookup_str(struct ts_node *root, const char *path, const char *def_val)
 {
 	struct ts_attr *attr = ts_lookup(root, path);
-	if(!attr || !attr->val.str) {
+	const char *str;
+
+	if(!attr || !(str = ts_get_value_str(&attr->val))) {
 		return def_val;
 	}
-	return attr->val.str;
+	return str;
 }
 
 float ts_lookup_num(struct ts_node *root, const char *path, float def_val)
@@ -838,22 +1889,325 @@ float *ts_lookup_vec(struct ts_node *root, const char *path, float *def_val)
 struct ts_value *ts_lookup_array(struct ts_node *node, const char *path, struct ts_value *def_val)
 {
 	struct ts_attr *attr = ts_lookup(node, path);
-	if(!attr || !attr->val.array) {
+	struct ts_value *arr;
+
+	if(!attr || !(arr = ts_get_value_array(&attr->val))) {
+		return def_val;
+	}
+	return arr;
+}
+
+/* compiled path: the segments are interned and hashed up front, the first one
+ * names the root, and the last one the attribute. A copy of the path follows
+ * the segments, for the names which can't be interned.
+ */
+struct ts_path {
+	int count;
+	struct path_seg {
+		const char *name;
+		int atom;
+		unsigned int hash;
+	} seg[1];
+};
+
+struct ts_path *ts_compile_path(const char *path)
+{
+	int i, count = 1;
+	long len;
+	const char *p, *end;
+	char *copy;
+	struct ts_path *cpath;
+
+	for(p=path; *p; p++) {
+		if(*p == '.') count++;
+	}
+	if(count < 2) {
+		return 0;
+	}
+	if(!(cpath = malloc(sizeof *cpath + (count - 1) * sizeof *cpath->seg + (p - path) + 1))) {
+		return 0;
+	}
+	cpath->count = count;
+	copy = (char*)(cpath->seg + count);
+	memcpy(copy, path, p - path + 1);
+
+	p = path;
+	for(i=0; i<count; i++) {
+		struct path_seg *seg = cpath->seg + i;
+
+		if(!(end = strchr(p, '.'))) {
+			end = p + strlen(p);
+		}
+		len = end - p;
+		seg->hash = ts_intern_hash(p, len);
+		if((seg->atom = ts_intern_len(p, len, seg->hash, &seg->name)) == -1) {
+			free(cpath);
+			return 0;
+		}
+		if(!seg->atom) {
+			copy[end - path] = 0;
+			seg->name = copy + (p - path);
+		}
+		p = end + 1;
+	}
+	return cpath;
+}
+
+void ts_free_path(struct ts_path *path)
+{
+	free(path);
+}
+
+/* names which aren't interned (atom 0) have to be compared as strings */
+#define SEG_MATCH(seg, n, a) \
+	((a) ? (a) == (seg)->atom : strcmp(NAME(n), (seg)->name) == 0)
+
+static struct ts_node *find_child(struct ts_node *node, const struct path_seg *seg)
+{
+	struct ts_node *c;
+
+	if(node->lazy) ts_expand_node(node);
+
+	if(node->child_index) {
+		return index_find(node->child_index, seg->name, seg->hash)->first;
+	}
+
+	c = node->child_list;
+	while(c) {
+		if(SEG_MATCH(seg, c->name, c->name_atom)) {
+			return c;
+		}
+		c = c->next;
+	}
+	return 0;
+}
+
+static struct ts_attr *find_attr(struct ts_node *node, const struct path_seg *seg)
+{
+	struct ts_attr *attr;
+
+	if(node->lazy) ts_expand_node(node);
+
+	if(node->attr_index) {
+		return index_find(node->attr_index, seg->name, seg->hash)->first;
+	}
+
+	attr = node->attr_list;
+	while(attr) {
+		if(SEG_MATCH(seg, attr->name, attr->name_atom)) {
+			return attr;
+		}
+		attr = attr->next;
+	}
+	return 0;
+}
+
+struct ts_attr *ts_lookup_compiled(struct ts_node *node, const struct ts_path *path)
+{
+	int i;
+	const struct path_seg *seg = path->seg;
+
+	if(!node || !SEG_MATCH(seg, node->name, node->name_atom)) {
+		return 0;
+	}
+
+	for(i=1; i<path->count - 1; i++) {
+		if(!(node = find_child(node, seg + i))) {
+			return 0;
+		}
+	}
+	return find_attr(node, seg + path->count - 1);
+}
+
+const char *ts_lookup_compiled_str(struct ts_node *root, const struct ts_path *path, const char *def_val)
+{
+	struct ts_attr *attr = ts_lookup_compiled(root, path);
+	const char *str;
+
+	if(!attr || !(str = ts_get_value_str(&attr->val))) {
 		return def_val;
 	}
-	return attr->val.array;
+	return str;
+}
+
+float ts_lookup_compiled_num(struct ts_node *root, const struct ts_path *path, float def_val)
+{
+	struct ts_attr *attr = ts_lookup_compiled(root, path);
+	if(!attr || attr->val.type != TS_NUMBER) {
+		return def_val;
+	}
+	return attr->val.fnum;
+}
+
+int ts_lookup_compiled_int(struct ts_node *root, const struct ts_path *path, int def_val)
+{
+	struct ts_attr *attr = ts_lookup_compiled(root, path);
+	if(!attr || attr->val.type != TS_NUMBER) {
+		return def_val;
+	}
+	return attr->val.inum;
+}
+
+float *ts_lookup_compiled_vec(struct ts_node *root, const struct ts_path *path, float *def_val)
+{
+	struct ts_attr *attr = ts_lookup_compiled(root, path);
+	if(!attr || !attr->val.vec) {
+		return def_val;
+	}
+	return attr->val.vec;
+}
+
+struct ts_value *ts_lookup_compiled_array(struct ts_node *root, const struct ts_path *path, struct ts_value *def_val)
+{
+	struct ts_attr *attr = ts_lookup_compiled(root, path);
+	struct ts_value *arr;
+
+	if(!attr || !(arr = ts_get_value_array(&attr->val))) {
+		return def_val;
+	}
+	return arr;
 }
 
 static long io_read(void *buf, size_t bytes, void *uptr)
 {
 	size_t sz = fread(buf, 1, bytes, uptr);
-	if(sz < bytes && errno) return -1;
+	if(sz < bytes && ferror(uptr)) return -1;
 	return sz;
 }
 
 static long io_write(const void *buf, size_t bytes, void *uptr)
 {
 	size_t sz = fwrite(buf, 1, bytes, uptr);
-	if(sz < bytes && errno) return -1;
+	if(sz < bytes && ferror(uptr)) return -1;
 	return sz;
 }
+
+static long peekio_read(void *buf, size_t bytes, void *uptr)
+{
+	struct peekio *pk = uptr;
+
+	if(pk->pos < pk->len) {
+		if(bytes > pk->len - pk->pos) {
+			bytes = pk->len - pk->pos;
+		}
+		memcpy(buf, pk->buf + pk->pos, bytes);
+		pk->pos += bytes;
+		return bytes;
+	}
+	return pk->io->read(buf, bytes, pk->io->data);
+}
+
+/* lazy and parallel loads take ownership of the input data */
+static struct ts_node *load_text_inmem(void *data, size_t size, void (*release)(void*, size_t))
+{
+	if(loadflags & TS_LOAD_LAZY) {
+		return ts_text_load_lazy(data, size, release);
+	}
+	return ts_text_load_parallel(data, size, release);
+}
+
+/* lazy and parallel loads need the whole input in memory, read it all and hand
+ * it over to the text loader
+ */
+static struct ts_node *load_whole_io(struct ts_io *io)
+{
+	char *buf = 0, *tmp;
+	size_t size = 0, max_size = 0;
+	long rdsz;
+	struct ts_node *n;
+
+	for(;;) {
+		if(size >= max_size) {
+			max_size = max_size ? max_size * 2 : 65536;
+			if(!(tmp = realloc(buf, max_size))) {
+				perror("ts_load_io: failed to allocate input buffer");
+				free(buf);
+				return 0;
+			}
+			buf = tmp;
+		}
+		if((rdsz = io->read(buf + size, max_size - size, io->data)) <= 0) {
+			break;
+		}
+		size += rdsz;
+	}
+	if(rdsz < 0) {
+		fprintf(stderr, "ts_load_io: read failed\n");
+		free(buf);
+		return 0;
+	}
+	if(ts_bin_check(buf, size)) {
+		n = ts_bin_load_mem(buf, size);
+		free(buf);
+		return n;
+	}
+	return load_text_inmem(buf, size, free_data);
+}
+
+static void free_data(void *data, size_t size)
+{
+	free(data);
+}
+
+static void keep_data(void *data, size_t size)
+{
+}
+
+#ifdef USE_MMAP
+static void unmap_data(void *data, size_t size)
+{
+	munmap(data, size);
+}
+#endif
+
+static int open_infile(struct infile *inf, const char *fname, const char *funcname)
+{
+#ifdef USE_MMAP
+	int fd;
+	struct stat st;
+
+	inf->mem = 0;
+	inf->fp = 0;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		fprintf(stderr, "%s: failed to open file: %s: %s\n", funcname, fname, strerror(errno));
+		return -1;
+	}
+	if(fstat(fd, &st) != -1 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+			(inf->mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+		close(fd);
+		inf->size = st.st_size;
+#ifdef MADV_SEQUENTIAL
+		madvise(inf->mem, inf->size, MADV_SEQUENTIAL);
+#endif
+		return 0;
+	}
+	inf->mem = 0;
+
+	/* can't map it (empty file, pipe, etc), fall back to reading through stdio */
+	if(!(inf->fp = fdopen(fd, "rb"))) {
+		fprintf(stderr, "%s: failed to open file: %s: %s\n", funcname, fname, strerror(errno));
+		close(fd);
+		return -1;
+	}
+#else
+	inf->mem = 0;
+	if(!(inf->fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "%s: failed to open file: %s: %s\n", funcname, fname, strerror(errno));
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static void close_infile(struct infile *inf)
+{
+#ifdef USE_MMAP
+	if(inf->mem) {
+		munmap(inf->mem, inf->size);
+	}
+#endif
+	if(inf->fp) {
+		fclose(inf->fp);
+	}
+}
@@ -0,0 +1,61 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdio.h>
+#include "treestor.h"
+
+/* number of failed checks, the test exits with failure if it's not 0 */
+extern int test_fail;
+
+#define CHECK(x) \
+	do { \
+		if(!(x)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			test_fail++; \
+		} \
+	} while(0)
+
+extern const char *test_sample;
+
+/* compare two trees, expanding lazy nodes as needed. Returns 0 if they are the
+ * same, or -1 and prints the first difference.
+ */
+int test_cmp_tree(struct ts_node *a, struct ts_node *b);
+
+/* check the links, counts and name lookups of every node in the tree. Returns
+ * the number of problems found.
+ */
+int test_check_tree(struct ts_node *tree);
+
+/* save the tree in memory with the given mode, returns a malloced buffer */
+char *test_save_mem(struct ts_node *tree, enum ts_save_mode mode, long *size);
+
+struct ts_node *test_load_str(const char *str);
+
+#endif	/* TEST_H_ */
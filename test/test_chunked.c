@@ -0,0 +1,145 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+/* push parser and ts_load_io with the input split in small pieces */
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+struct reader {
+	const char *buf;
+	long size, pos;
+	int maxrd;
+};
+
+static long read_few(void *buf, size_t bytes, void *uptr)
+{
+	struct reader *rd = uptr;
+	long n = bytes < (size_t)rd->maxrd ? (long)bytes : rd->maxrd;
+
+	if(n > rd->size - rd->pos) n = rd->size - rd->pos;
+	memcpy(buf, rd->buf + rd->pos, n);
+	rd->pos += n;
+	return n;
+}
+
+/* feed the input in chunks of the given size, or random sizes if it's 0 */
+static struct ts_node *push_parse(struct ts_parser *p, const char *buf, long size, int chunk)
+{
+	long n, pos = 0;
+
+	while(pos < size) {
+		n = chunk > 0 ? chunk : rand() % 50 + 1;
+		if(n > size - pos) n = size - pos;
+		if(ts_parser_feed(p, buf + pos, n) == -1) {
+			break;
+		}
+		pos += n;
+	}
+	return ts_parser_finish(p);
+}
+
+int main(void)
+{
+	int i;
+	long size;
+	char *bin;
+	struct ts_node *ref, *tree;
+	struct ts_parser *p;
+	struct ts_io io = {0};
+	struct reader rd;
+	static const char *bad[] = {
+		"root { a = 1",
+		"root { a = }",
+		"root { a = \"unterminated }",
+		"root { a = [1, 2 }",
+		"{ }",
+		""
+	};
+
+	if(!(ref = test_load_str(test_sample))) {
+		printf("failed to load the sample\n");
+		return 1;
+	}
+	size = strlen(test_sample);
+
+	if(!(p = ts_alloc_parser())) {
+		printf("failed to allocate parser\n");
+		return 1;
+	}
+
+	/* the same parser is reused for every document */
+	srand(1);
+	for(i=0; i<40; i++) {
+		tree = push_parse(p, test_sample, size, i < 32 ? i + 1 : 0);
+		CHECK(tree && test_cmp_tree(ref, tree) == 0);
+		ts_free_tree(tree);
+	}
+
+	for(i=0; i<(int)(sizeof bad / sizeof *bad); i++) {
+		tree = push_parse(p, bad[i], strlen(bad[i]), 1);
+		CHECK(tree == 0);
+		ts_free_tree(tree);
+
+		tree = test_load_str(bad[i]);
+		CHECK(tree == 0);
+		ts_free_tree(tree);
+	}
+
+	/* a failed parse doesn't affect the next one */
+	tree = push_parse(p, test_sample, size, 7);
+	CHECK(tree && test_cmp_tree(ref, tree) == 0);
+	ts_free_tree(tree);
+	ts_free_parser(p);
+
+	/* pull loading through short reads, text and binary */
+	io.read = read_few;
+	io.data = &rd;
+	bin = test_save_mem(ref, TS_BIN, &size);
+	CHECK(bin != 0);
+	for(i=1; i<=17; i+=4) {
+		rd.buf = test_sample;
+		rd.size = strlen(test_sample);
+		rd.pos = 0;
+		rd.maxrd = i;
+		tree = ts_load_io(&io);
+		CHECK(tree && test_cmp_tree(ref, tree) == 0);
+		ts_free_tree(tree);
+
+		if(bin) {
+			rd.buf = bin;
+			rd.size = size;
+			rd.pos = 0;
+			tree = ts_load_io(&io);
+			CHECK(tree && test_cmp_tree(ref, tree) == 0);
+			ts_free_tree(tree);
+		}
+	}
+	free(bin);
+
+	ts_free_tree(ref);
+	return test_fail ? 1 : 0;
+}
@@ -0,0 +1,344 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+/* malformed and hostile binary input */
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+#define MAX_DEPTH	1024
+
+enum { BVAL_STR, BVAL_INT, BVAL_FLOAT, BVAL_VEC, BVAL_ARR, BVAL_STRREF };
+
+/* binary file writer, for building files the library wouldn't write */
+struct bfile {
+	unsigned char buf[65536];
+	long size;
+};
+
+static void put8(struct bfile *bf, int x)
+{
+	if(bf->size < (long)sizeof bf->buf) {
+		bf->buf[bf->size++] = x;
+	}
+}
+
+static void put32(struct bfile *bf, unsigned long x)
+{
+	put8(bf, x & 0xff);
+	put8(bf, (x >> 8) & 0xff);
+	put8(bf, (x >> 16) & 0xff);
+	put8(bf, (x >> 24) & 0xff);
+}
+
+static void set32(struct bfile *bf, long offs, unsigned long x)
+{
+	long size = bf->size;
+	bf->size = offs;
+	put32(bf, x);
+	bf->size = size;
+}
+
+/* starts a chunk, returns the offset of the size field */
+static long begin_chunk(struct bfile *bf, const char *id)
+{
+	put8(bf, id[0]);
+	put8(bf, id[1]);
+	put8(bf, id[2]);
+	put8(bf, id[3]);
+	put32(bf, 0);
+	return bf->size - 4;
+}
+
+static void end_chunk(struct bfile *bf, long offs)
+{
+	set32(bf, offs, bf->size - offs - 4);
+}
+
+/* header and a string table with the names "n" and "s" */
+static void begin_file(struct bfile *bf)
+{
+	long offs;
+
+	bf->size = 0;
+	put8(bf, 0x7f);
+	put8(bf, 'T');
+	put8(bf, 'S');
+	put8(bf, 'B');
+	put32(bf, 1);
+
+	offs = begin_chunk(bf, "STRT");
+	put32(bf, 2);
+	put8(bf, 'n');
+	put8(bf, 0);
+	put8(bf, 's');
+	put8(bf, 0);
+	end_chunk(bf, offs);
+}
+
+static long begin_node(struct bfile *bf, int nattr, int nchild)
+{
+	long offs = begin_chunk(bf, "NODE");
+	put32(bf, 0);
+	put32(bf, nattr);
+	put32(bf, nchild);
+	return offs;
+}
+
+static struct ts_node *load(struct bfile *bf)
+{
+	struct ts_node *tree = ts_load_mem(bf->buf, bf->size);
+	if(tree) {
+		CHECK(test_check_tree(tree) == 0);
+	}
+	return tree;
+}
+
+static void check_loads(struct bfile *bf)
+{
+	struct ts_node *tree = load(bf);
+	CHECK(tree != 0);
+	ts_free_tree(tree);
+}
+
+static void check_fails(struct bfile *bf)
+{
+	struct ts_node *tree = load(bf);
+	CHECK(tree == 0);
+	ts_free_tree(tree);
+}
+
+/* a root node with one attribute, with the value written by the caller */
+static long begin_attr_file(struct bfile *bf, int type)
+{
+	long offs;
+
+	begin_file(bf);
+	offs = begin_node(bf, 1, 0);
+	put32(bf, 1);
+	put8(bf, type);
+	return offs;
+}
+
+static void test_crafted(void)
+{
+	static struct bfile bf;
+	long offs[MAX_DEPTH + 2];
+	int i;
+
+	/* the smallest valid file */
+	begin_file(&bf);
+	end_chunk(&bf, begin_node(&bf, 0, 0));
+	check_loads(&bf);
+
+	/* nested nodes, up to the depth limit and past it */
+	begin_file(&bf);
+	for(i=0; i<MAX_DEPTH + 1; i++) {
+		offs[i] = begin_node(&bf, 0, i < MAX_DEPTH ? 1 : 0);
+	}
+	while(--i >= 0) end_chunk(&bf, offs[i]);
+	check_loads(&bf);
+
+	begin_file(&bf);
+	for(i=0; i<MAX_DEPTH + 2; i++) {
+		offs[i] = begin_node(&bf, 0, i < MAX_DEPTH + 1 ? 1 : 0);
+	}
+	while(--i >= 0) end_chunk(&bf, offs[i]);
+	check_fails(&bf);
+
+	/* nested arrays past the depth limit */
+	offs[0] = begin_attr_file(&bf, BVAL_ARR);
+	for(i=0; i<MAX_DEPTH + 1; i++) {
+		put32(&bf, 1);
+		put8(&bf, BVAL_ARR);
+	}
+	put32(&bf, 0);
+	end_chunk(&bf, offs[0]);
+	check_fails(&bf);
+
+	/* counts far larger than the data */
+	begin_file(&bf);
+	end_chunk(&bf, begin_node(&bf, 0x7fffffff, 0));
+	check_fails(&bf);
+
+	begin_file(&bf);
+	end_chunk(&bf, begin_node(&bf, 0, -1));
+	check_fails(&bf);
+
+	offs[0] = begin_attr_file(&bf, BVAL_VEC);
+	put32(&bf, 0x40000000);
+	put32(&bf, 0);
+	end_chunk(&bf, offs[0]);
+	check_fails(&bf);
+
+	offs[0] = begin_attr_file(&bf, BVAL_ARR);
+	put32(&bf, 0xffffffff);
+	put8(&bf, BVAL_INT);
+	put32(&bf, 0);
+	end_chunk(&bf, offs[0]);
+	check_fails(&bf);
+
+	offs[0] = begin_attr_file(&bf, BVAL_STR);
+	put32(&bf, 0xfffffff0);
+	put32(&bf, 0);
+	end_chunk(&bf, offs[0]);
+	check_fails(&bf);
+
+	/* string and name references out of range */
+	offs[0] = begin_attr_file(&bf, BVAL_STRREF);
+	put32(&bf, 2);
+	end_chunk(&bf, offs[0]);
+	check_fails(&bf);
+
+	begin_file(&bf);
+	offs[0] = begin_chunk(&bf, "NODE");
+	put32(&bf, 5);
+	put32(&bf, 0);
+	put32(&bf, 0);
+	end_chunk(&bf, offs[0]);
+	check_fails(&bf);
+
+	/* bad value type */
+	offs[0] = begin_attr_file(&bf, 42);
+	put32(&bf, 0);
+	end_chunk(&bf, offs[0]);
+	check_fails(&bf);
+
+	/* chunk sizes that don't match the contents */
+	begin_file(&bf);
+	offs[0] = begin_node(&bf, 0, 0);
+	set32(&bf, offs[0], 0xfffffff0);
+	check_fails(&bf);
+
+	begin_file(&bf);
+	offs[0] = begin_node(&bf, 0, 1);
+	end_chunk(&bf, begin_node(&bf, 0, 0));
+	end_chunk(&bf, offs[0]);
+	set32(&bf, offs[0], 12);
+	check_fails(&bf);
+
+	/* string table claiming more strings than it has */
+	begin_file(&bf);
+	set32(&bf, 12, 1000);
+	end_chunk(&bf, begin_node(&bf, 0, 0));
+	check_fails(&bf);
+
+	/* wrong version */
+	begin_file(&bf);
+	end_chunk(&bf, begin_node(&bf, 0, 0));
+	set32(&bf, 4, 99);
+	check_fails(&bf);
+}
+
+/* a chain of nodes as deep as the binary format allows, or one more */
+static void test_deep_save(void)
+{
+	int i;
+	long size;
+	char *buf;
+	struct ts_node *root, *node, *c;
+
+	root = node = ts_alloc_node();
+	ts_set_node_name(root, "n");
+	for(i=0; i<MAX_DEPTH; i++) {
+		c = ts_alloc_node();
+		ts_set_node_name(c, "n");
+		ts_add_child(node, c);
+		node = c;
+	}
+
+	buf = test_save_mem(root, TS_BIN, &size);
+	CHECK(buf != 0);
+	if(buf) {
+		node = ts_load_mem(buf, size);
+		CHECK(node && test_cmp_tree(root, node) == 0);
+		ts_free_tree(node);
+		free(buf);
+	}
+
+	c = ts_alloc_node();
+	ts_set_node_name(c, "n");
+	node = root;
+	while(node->child_list) node = node->child_list;
+	ts_add_child(node, c);
+
+	buf = test_save_mem(root, TS_BIN, &size);
+	CHECK(buf == 0);
+	free(buf);
+	ts_free_tree(root);
+}
+
+/* truncated and corrupted copies of a valid file */
+static void test_damaged(void)
+{
+	int i;
+	long size, len;
+	char *buf, *copy;
+	struct ts_node *ref, *tree;
+
+	if(!(ref = test_load_str(test_sample))) {
+		CHECK(!"failed to load the sample");
+		return;
+	}
+	buf = test_save_mem(ref, TS_BIN, &size);
+	ts_free_tree(ref);
+	if(!buf) {
+		CHECK(!"save failed");
+		return;
+	}
+	copy = malloc(size);
+
+	for(len=0; len<size; len++) {
+		memcpy(copy, buf, len);
+		tree = ts_load_mem(copy, len);
+		CHECK(tree == 0);
+		ts_free_tree(tree);
+	}
+
+	srand(1);
+	for(i=0; i<20000; i++) {
+		memcpy(copy, buf, size);
+		copy[rand() % size] ^= 1 << (rand() % 8);
+		if(rand() & 1) {
+			copy[rand() % size] = rand();
+		}
+		if((tree = ts_load_mem(copy, size))) {
+			CHECK(test_check_tree(tree) == 0);
+			ts_free_tree(tree);
+		}
+	}
+
+	free(copy);
+	free(buf);
+}
+
+int main(void)
+{
+	test_crafted();
+	test_deep_save();
+	test_damaged();
+	return test_fail ? 1 : 0;
+}
@@ -0,0 +1,335 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+/* name indexes, lookup caches and compiled paths while the tree changes */
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+static const char *paths[] = {
+	"root.top3.c4.x", "root.top1.a7", "root.top3.nope.x", "wrong.top1.a7",
+	"root.top0.a1", "root.top2.c3.x", "root.new.a", "root.top4.c1.y",
+	"root.top1.a30", "root.top0.c9.x", "root.top2.a0"
+};
+#define NPATHS	((int)(sizeof paths / sizeof *paths))
+
+/* lookup following the lists, without any of the indexes or caches */
+static struct ts_attr *plain_lookup(struct ts_node *node, const char *path)
+{
+	char name[64];
+	const char *end;
+	struct ts_attr *attr;
+	int len, first = 1;
+
+	while((end = strchr(path, '.'))) {
+		len = end - path;
+		memcpy(name, path, len);
+		name[len] = 0;
+		path = end + 1;
+
+		if(first) {
+			if(strcmp(node->name, name) != 0) return 0;
+			first = 0;
+		} else {
+			node = ts_get_child_list(node);
+			while(node && strcmp(node->name, name) != 0) {
+				node = node->next;
+			}
+			if(!node) return 0;
+		}
+	}
+	if(first) return 0;
+
+	attr = ts_get_attr_list(node);
+	while(attr && strcmp(attr->name, path) != 0) {
+		attr = attr->next;
+	}
+	return attr;
+}
+
+static struct ts_node *nth_child(struct ts_node *node, int n)
+{
+	struct ts_node *c = ts_get_child_list(node);
+	while(c && n-- > 0) c = c->next;
+	return c;
+}
+
+static struct ts_attr *new_attr(struct ts_node *tree, const char *name, int val)
+{
+	struct ts_attr *attr = tree->arena ? ts_alloc_attr_from(tree) : ts_alloc_attr();
+	ts_set_attr_name(attr, name);
+	ts_set_valuei(&attr->val, val);
+	return attr;
+}
+
+static struct ts_node *new_node(struct ts_node *tree, const char *name)
+{
+	struct ts_node *node = tree->arena && (rand() & 1) ? ts_alloc_node_from(tree) : ts_alloc_node();
+	ts_set_node_name(node, name);
+	return node;
+}
+
+/* random changes to the children and attributes of a node with many of them,
+ * so that it gets name indexes
+ */
+static void test_index(int arena)
+{
+	int i, idx;
+	char name[32];
+	struct ts_node *root, *other, *c;
+	struct ts_attr *attr;
+
+	root = arena ? ts_alloc_arena_tree() : ts_alloc_node();
+	ts_set_node_name(root, "root");
+	other = ts_alloc_node();
+	ts_set_node_name(other, "other");
+
+	srand(2);
+	for(i=0; i<3000; i++) {
+		int op = rand() % 14;
+		sprintf(name, "child%d", rand() % 60);
+
+		if(op < 6 || root->child_count < 5 || root->attr_count < 5) {
+			ts_add_child(root, new_node(root, name));
+			ts_add_attr(root, new_attr(root, name + 2, i));
+		} else if(op < 9) {
+			c = nth_child(root, rand() % root->child_count);
+			if(op == 8) {
+				ts_add_child(other, c);		/* moves it */
+			} else {
+				ts_remove_child(root, c);
+				ts_free_tree(c);
+			}
+		} else if(op < 11) {
+			c = nth_child(root, rand() % root->child_count);
+			ts_set_node_name(c, name);
+		} else if(op < 13) {
+			idx = rand() % root->attr_count;
+			attr = ts_get_attr_list(root);
+			while(idx-- > 0) attr = attr->next;
+			if(op == 11) {
+				ts_set_attr_name(attr, name + 2);
+			} else {
+				ts_remove_attr(root, attr);
+				ts_free_attr(attr);
+			}
+		} else if(other->child_count) {
+			c = nth_child(other, rand() % other->child_count);
+			ts_remove_child(other, c);
+			ts_add_child(root, c);
+		}
+
+		if(i % 10 == 0 || i > 2900) {
+			CHECK(test_check_tree(root) == 0);
+			CHECK(test_check_tree(other) == 0);
+		}
+	}
+	CHECK(ts_get_child_atom(root, 0) == 0);
+
+	ts_free_tree(other);
+	ts_free_tree(root);
+}
+
+static char *gen_text(void)
+{
+	int i, j;
+	char *buf, *ptr;
+
+	if(!(buf = malloc(65536))) {
+		return 0;
+	}
+	ptr = buf + sprintf(buf, "root {\n");
+	for(i=0; i<5; i++) {
+		ptr += sprintf(ptr, "\ttop%d {\n", i);
+		for(j=0; j<40; j++) {
+			ptr += sprintf(ptr, "\t\ta%d = %d\n", (j * 7 + i) % 23, j);
+		}
+		for(j=0; j<20; j++) {
+			ptr += sprintf(ptr, "\t\tc%d { x = %d\n\t\t\ty = %d }\n", (j * 3 + i) % 11, j, i);
+		}
+		ptr += sprintf(ptr, "\t}\n");
+	}
+	strcpy(ptr, "}\n");
+	return buf;
+}
+
+/* changes the tree in ways that may change lookup results */
+static void mutate(struct ts_node *tree, int i)
+{
+	int what = rand() % 5, n = rand() % 30;
+	struct ts_node *top, *c;
+	struct ts_attr *attr;
+	char name[32];
+
+	top = nth_child(tree, rand() % tree->child_count);
+	sprintf(name, "a%d", n);
+
+	switch(what) {
+	case 0:
+		/* add an attribute, and remove the one it was shadowed by */
+		ts_add_attr(top, new_attr(tree, name, 1000 + i));
+		if((attr = ts_get_attr(top, name)) && attr != top->attr_tail) {
+			ts_remove_attr(top, attr);
+			ts_free_attr(attr);
+		}
+		break;
+	case 1:
+		if((attr = ts_get_attr_list(top))) {
+			ts_remove_attr(top, attr);
+			ts_free_attr(attr);
+		}
+		break;
+	case 2:
+		if((attr = ts_get_attr_list(top))) {
+			ts_set_attr_name(attr, name);
+		}
+		break;
+	case 3:
+		if((c = ts_get_child_list(top))) {
+			ts_remove_child(top, c);
+			ts_free_tree(c);
+		}
+		break;
+	default:
+		if((c = ts_get_child_list(top))) {
+			sprintf(name, "c%d", n % 11);
+			ts_set_node_name(c, name);
+		}
+		sprintf(name, "top%d", n % 6);
+		ts_set_node_name(top, name);
+	}
+}
+
+static void test_lookup(const char *text, unsigned int flags, int cache_size)
+{
+	int i, j;
+	struct ts_node *tree;
+	struct ts_attr *attr;
+	struct ts_path *cpath[NPATHS];
+
+	ts_set_load_flags(flags);
+	tree = test_load_str(text);
+	ts_set_load_flags(0);
+	if(!tree) {
+		CHECK(!"load failed");
+		return;
+	}
+	CHECK(ts_set_lookup_cache(tree, cache_size) == 0);
+
+	for(i=0; i<NPATHS; i++) {
+		cpath[i] = ts_compile_path(paths[i]);
+		CHECK(cpath[i] != 0);
+	}
+
+	srand(5);
+	for(i=0; i<3000; i++) {
+		j = rand() % NPATHS;
+		attr = plain_lookup(tree, paths[j]);
+		CHECK(ts_lookup(tree, paths[j]) == attr);
+		CHECK(ts_lookup_compiled(tree, cpath[j]) == attr);
+		if(attr) {
+			CHECK(ts_lookup_int(tree, paths[j], -1) == attr->val.inum);
+		}
+
+		/* value changes keep the cached attribute */
+		if(attr && rand() % 8 == 0) {
+			ts_set_valuei(&attr->val, i);
+			CHECK(ts_lookup_int(tree, paths[j], -1) == i);
+		}
+
+		if(rand() % 20 == 0) {
+			mutate(tree, i);
+		}
+	}
+
+	/* removing the cache leaves lookups working */
+	CHECK(ts_set_lookup_cache(tree, 0) == 0);
+	for(i=0; i<NPATHS; i++) {
+		CHECK(ts_lookup(tree, paths[i]) == plain_lookup(tree, paths[i]));
+		ts_free_path(cpath[i]);
+	}
+	CHECK(test_check_tree(tree) == 0);
+	ts_free_tree(tree);
+}
+
+static int count_query(struct ts_node *tree, const char *query)
+{
+	int count = 0;
+	struct ts_query *q;
+
+	if(!(q = ts_query(tree, query))) {
+		return -1;
+	}
+	while(ts_query_next(q)) count++;
+	ts_query_free(q);
+	return count;
+}
+
+static void test_query(const char *text)
+{
+	struct ts_node *tree, *c;
+
+	if(!(tree = test_load_str(text))) {
+		CHECK(!"load failed");
+		return;
+	}
+	CHECK(count_query(tree, "root.*") == 5);
+	CHECK(count_query(tree, "root.**") == 106);
+	CHECK(count_query(tree, "root.*.c0") == 9);
+	CHECK(count_query(tree, "root.**.*[x=3]") == 5);
+	CHECK(count_query(tree, "root.top2.*[y=2.0]") == 20);
+	CHECK(count_query(tree, "root.*[a5]") == 5);
+	CHECK(count_query(tree, "root.top9") == 0);
+	CHECK(count_query(tree, "root.*[") == -1);
+
+	/* renames are seen by new queries */
+	c = ts_get_child(tree, "top1");
+	ts_set_node_name(c, "renamed");
+	CHECK(count_query(tree, "root.top1") == 0);
+	CHECK(count_query(tree, "root.renamed.c1") == 2);
+	ts_free_tree(tree);
+}
+
+int main(void)
+{
+	char *text;
+
+	test_index(0);
+	test_index(1);
+
+	if(!(text = gen_text())) {
+		return 1;
+	}
+	test_lookup(text, 0, 64);
+	test_lookup(text, 0, 4);
+	test_lookup(text, TS_LOAD_ARENA, 64);
+	test_lookup(text, TS_LOAD_LAZY, 64);
+	test_lookup(text, TS_LOAD_LAZY | TS_LOAD_ARENA, 16);
+	test_query(text);
+	free(text);
+
+	return test_fail ? 1 : 0;
+}
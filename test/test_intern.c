@@ -0,0 +1,121 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+/* names past the intern table limit are stored with the tree instead */
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+static void build(struct ts_node *root, int count)
+{
+	int i;
+	char name[32];
+	struct ts_node *c;
+	struct ts_attr *attr;
+
+	for(i=0; i<count; i++) {
+		sprintf(name, "n%d", i);
+		c = root->arena ? ts_alloc_node_from(root) : ts_alloc_node();
+		ts_set_node_name(c, name);
+		ts_set_node_name(c, "renamed");
+		ts_set_node_name(c, name);
+		ts_add_child(root, c);
+
+		attr = root->arena ? ts_alloc_attr_from(root) : ts_alloc_attr();
+		ts_set_attr_name(attr, name);
+		ts_set_value_str(&attr->val, name);
+		ts_add_attr(c, attr);
+	}
+}
+
+static void test_built(int arena)
+{
+	struct ts_node *root = arena ? ts_alloc_arena_tree() : ts_alloc_node();
+	struct ts_node *copy;
+	char *buf;
+	long size;
+
+	ts_set_node_name(root, "root");
+	build(root, 100);
+
+	CHECK(strcmp(ts_lookup_str(root, "root.n42.n42", ""), "n42") == 0);
+	CHECK(ts_get_child(root, "n77") && ts_get_child(root, "n77")->name_atom == 0);
+	CHECK(ts_get_child_atom(root, 0) == 0);
+	CHECK(ts_get_attr_atom(ts_get_child(root, "n1"), 0) == 0);
+	CHECK(test_check_tree(root) == 0);
+
+	if((buf = test_save_mem(root, TS_BIN, &size))) {
+		copy = ts_load_mem(buf, size);
+		CHECK(copy && test_cmp_tree(root, copy) == 0);
+		ts_free_tree(copy);
+		free(buf);
+	}
+	ts_free_tree(root);
+}
+
+int main(void)
+{
+	unsigned int i;
+	struct ts_node *tree, *ref;
+	char *buf;
+	long size;
+	static const unsigned int flags[] = {
+		0, TS_LOAD_LAZY, TS_LOAD_PARALLEL, TS_LOAD_ARENA, TS_LOAD_LAZY | TS_LOAD_ARENA
+	};
+
+	/* nothing fits in the table */
+	ts_set_intern_limit(1);
+	CHECK(ts_intern("rootnode") == 0);
+
+	if(!(ref = test_load_str(test_sample))) {
+		printf("failed to load the sample\n");
+		return 1;
+	}
+	CHECK(ref->name_atom == 0 && ref->attr_list->name_atom == 0);
+	CHECK(strcmp(ts_lookup_str(ref, "rootnode.childnode.childattr", ""), "whatever") == 0);
+	buf = test_save_mem(ref, TS_BIN, &size);
+	CHECK(buf != 0);
+
+	test_built(0);
+	test_built(1);
+
+	for(i=0; i<sizeof flags / sizeof *flags; i++) {
+		ts_set_load_flags(flags[i]);
+		tree = test_load_str(test_sample);
+		CHECK(tree && test_cmp_tree(ref, tree) == 0);
+		CHECK(tree && test_check_tree(tree) == 0);
+		ts_free_tree(tree);
+
+		tree = buf ? ts_load_mem(buf, size) : 0;
+		CHECK(tree && test_cmp_tree(ref, tree) == 0);
+		ts_free_tree(tree);
+	}
+	ts_set_load_flags(0);
+
+	free(buf);
+	ts_free_tree(ref);
+	return test_fail ? 1 : 0;
+}
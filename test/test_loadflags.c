@@ -0,0 +1,250 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+/* lazy, parallel and arena loading */
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+#define TMPFILE	"test_loadflags.tmp"
+
+static char *gen_text(int nchildren)
+{
+	int i;
+	char *buf, *ptr;
+
+	if(!(buf = malloc(nchildren * 128 + 64))) {
+		return 0;
+	}
+	ptr = buf + sprintf(buf, "root {\n\tcount = %d\n", nchildren);
+	for(i=0; i<nchildren; i++) {
+		ptr += sprintf(ptr, "\tn%d {\n\t\ti = %d\n\t\ts = \"str%d\"\n\t\tv = [%d, 1.5]\n"
+				"\t\tsub { x = %d }\n\t}\n", i % 50, i, i, i, -i);
+	}
+	strcpy(ptr, "}\n");
+	return buf;
+}
+
+static int write_file(const char *fname, const char *text)
+{
+	FILE *fp;
+
+	if(!(fp = fopen(fname, "wb"))) {
+		return -1;
+	}
+	fputs(text, fp);
+	fclose(fp);
+	return 0;
+}
+
+static void test_flags(const char *text, struct ts_node *ref, unsigned int flags)
+{
+	struct ts_node *tree;
+	char *copy;
+	long len = strlen(text);
+	FILE *fp;
+
+	ts_set_load_flags(flags);
+
+	/* the loader must not refer to the caller's buffer after returning */
+	copy = malloc(len);
+	memcpy(copy, text, len);
+	tree = ts_load_mem(copy, len);
+	memset(copy, '}', len);
+	free(copy);
+	CHECK(tree && test_cmp_tree(ref, tree) == 0);
+	CHECK(tree && test_check_tree(tree) == 0);
+	ts_free_tree(tree);
+
+	write_file(TMPFILE, text);
+	tree = ts_load(TMPFILE);
+	CHECK(tree && test_cmp_tree(ref, tree) == 0);
+	ts_free_tree(tree);
+
+	if((fp = fopen(TMPFILE, "rb"))) {
+		tree = ts_load_file(fp);
+		fclose(fp);
+		CHECK(tree && test_cmp_tree(ref, tree) == 0);
+		ts_free_tree(tree);
+	}
+
+	ts_set_load_flags(0);
+}
+
+static void test_lazy(const char *text, struct ts_node *ref)
+{
+	struct ts_node *tree, *c;
+	FILE *fp;
+	static const char *bad = "root {\n\tgood { a = 1 }\n\tbad { a = [1, 2 }\n}\n";
+
+	ts_set_load_flags(TS_LOAD_LAZY);
+
+	/* children are only parsed when accessed */
+	tree = test_load_str(text);
+	CHECK(tree != 0);
+	if(tree) {
+		c = tree->child_list;
+		CHECK(c && c->attr_count == 0 && c->child_count == 0);
+		CHECK(ts_get_attr_int(c, "i", -1) == 0);
+		CHECK(c->attr_count == 3 && c->child_count == 1);
+		CHECK(ts_expand_tree(tree) == 0);
+		CHECK(test_cmp_tree(ref, tree) == 0);
+		ts_free_tree(tree);
+	}
+
+	/* syntax errors in a node body are reported when it's expanded */
+	tree = test_load_str(bad);
+	CHECK(tree != 0);
+	if(tree) {
+		CHECK(ts_expand_node(ts_get_child(tree, "good")) == 0);
+		CHECK(ts_expand_node(ts_get_child(tree, "bad")) == -1);
+		ts_free_tree(tree);
+	}
+
+	/* changing or truncating the file after loading doesn't affect the tree */
+	write_file(TMPFILE, text);
+	tree = ts_load(TMPFILE);
+	CHECK(tree != 0);
+	if(tree && (fp = fopen(TMPFILE, "wb"))) {
+		fclose(fp);
+		CHECK(test_cmp_tree(ref, tree) == 0);
+	}
+	ts_free_tree(tree);
+
+	/* parallel loads parse everything up front */
+	ts_set_load_flags(TS_LOAD_PARALLEL);
+	tree = test_load_str(bad);
+	CHECK(tree == 0);
+	ts_free_tree(tree);
+
+	ts_set_load_flags(0);
+}
+
+static void test_arena(struct ts_node *ref)
+{
+	struct ts_node *tree, *node, *top;
+	struct ts_attr *attr;
+	char *text;
+	long size;
+
+	ts_set_load_flags(TS_LOAD_ARENA | TS_LOAD_LAZY);
+	tree = test_load_str(test_sample);
+	ts_set_load_flags(0);
+	if(!tree) {
+		CHECK(!"arena load failed");
+		return;
+	}
+
+	/* heap nodes and attributes mixed into an arena tree */
+	node = ts_alloc_node();
+	ts_set_node_name(node, "extra");
+	attr = ts_alloc_attr();
+	ts_set_attr_name(attr, "heap");
+	ts_set_value_str(&attr->val, "a heap string longer than the inline buffer");
+	ts_add_attr(node, attr);
+	ts_add_child(ts_get_child(tree, "childnode"), node);
+
+	attr = ts_get_attr(tree, "some_attribute");
+	CHECK(attr != 0);
+	if(attr) {
+		ts_set_value_str(&attr->val, "changed");
+		CHECK(strcmp(ts_lookup_str(tree, "rootnode.some_attribute", ""), "changed") == 0);
+	}
+	CHECK(strcmp(ts_lookup_str(tree, "rootnode.childnode.extra.heap", ""),
+				"a heap string longer than the inline buffer") == 0);
+
+	/* arena nodes removed and freed on their own */
+	node = ts_get_child(tree, "empty");
+	CHECK(node && ts_remove_child(tree, node) == 0);
+	ts_free_tree(node);
+	CHECK(test_check_tree(tree) == 0);
+
+	/* and the arena tree survives a save/load */
+	if((text = test_save_mem(tree, TS_TEXT, &size))) {
+		node = ts_load_mem(text, size);
+		CHECK(node && test_cmp_tree(tree, node) == 0);
+		ts_free_tree(node);
+		free(text);
+	}
+
+	/* an arena tree attached to a heap tree is freed with it */
+	top = ts_alloc_node();
+	ts_set_node_name(top, "top");
+	ts_add_child(top, tree);
+	ts_free_tree(top);
+
+	/* arena tree built from scratch */
+	tree = ts_alloc_arena_tree();
+	ts_set_node_name(tree, "rootnode");
+	node = ts_alloc_node_from(tree);
+	ts_set_node_name(node, "childnode");
+	attr = ts_alloc_attr_from(tree);
+	ts_set_attr_name(attr, "childattr");
+	ts_set_value_str(&attr->val, "whatever");
+	ts_add_attr(node, attr);
+	ts_add_child(tree, node);
+	attr = ts_alloc_attr_from(tree);
+	CHECK(ts_copy_attr(attr, ts_get_attr(ref, "vector_attrib")) == 0);
+	ts_add_attr(tree, attr);
+	CHECK(strcmp(ts_lookup_str(tree, "rootnode.childnode.childattr", ""), "whatever") == 0);
+	CHECK(ts_lookup_vec(tree, "rootnode.vector_attrib", 0) != 0);
+	ts_free_tree(tree);
+}
+
+int main(void)
+{
+	int i;
+	char *text;
+	struct ts_node *ref, *sample;
+	static const unsigned int flags[] = {
+		0, TS_LOAD_LAZY, TS_LOAD_PARALLEL, TS_LOAD_ARENA,
+		TS_LOAD_LAZY | TS_LOAD_PARALLEL, TS_LOAD_LAZY | TS_LOAD_ARENA,
+		TS_LOAD_PARALLEL | TS_LOAD_ARENA,
+		TS_LOAD_LAZY | TS_LOAD_PARALLEL | TS_LOAD_ARENA
+	};
+
+	if(!(text = gen_text(500)) || !(ref = test_load_str(text))) {
+		printf("failed to load the test tree\n");
+		return 1;
+	}
+	if(!(sample = test_load_str(test_sample))) {
+		printf("failed to load the sample\n");
+		return 1;
+	}
+
+	for(i=0; i<(int)(sizeof flags / sizeof *flags); i++) {
+		test_flags(text, ref, flags[i]);
+		test_flags(test_sample, sample, flags[i]);
+	}
+	test_lazy(text, ref);
+	test_arena(sample);
+
+	remove(TMPFILE);
+	ts_free_tree(sample);
+	ts_free_tree(ref);
+	free(text);
+	return test_fail ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+/* text and binary round-trips */
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+#define TMPFILE	"test_roundtrip.tmp"
+
+static void check_values(struct ts_node *tree)
+{
+	struct ts_node *node;
+	struct ts_attr *attr;
+	struct ts_value *arr;
+
+	CHECK(ts_lookup_int(tree, "rootnode.some_numeric_attrib", 0) == 10);
+	CHECK(ts_lookup_num(tree, "rootnode.neg", 0) == -3.5f);
+	CHECK(ts_lookup_num(tree, "rootnode.small", 0) == 0.25f);
+	CHECK(ts_lookup_num(tree, "rootnode.expo", 0) == -250.0f);
+	CHECK(ts_lookup_num(tree, "rootnode.huge", 0) > 1e38f);
+	CHECK(strcmp(ts_lookup_str(tree, "rootnode.dash", ""), "-") == 0);
+	CHECK(strcmp(ts_lookup_str(tree, "rootnode.range", ""), "5-3") == 0);
+	CHECK(strcmp(ts_lookup_str(tree, "rootnode.word", ""), "1x") == 0);
+	CHECK(strcmp(ts_lookup_str(tree, "rootnode.dots", ""), "1.2.3") == 0);
+	CHECK(strcmp(ts_lookup_str(tree, "rootnode.plus", ""), "+") == 0);
+	CHECK(strcmp(ts_lookup_str(tree, "rootnode.multi", ""), "line one\nline two") == 0);
+	CHECK(strcmp(ts_lookup_str(tree, "rootnode.childnode.childattr", ""), "whatever") == 0);
+	if((node = ts_get_next_child(ts_get_child(tree, "childnode")))) {
+		CHECK(ts_get_attr_int(ts_get_child(node, "deep"), "x", 0) == 1);
+	} else {
+		CHECK(!"second childnode missing");
+	}
+
+	if((attr = ts_lookup(tree, "rootnode.vector_attrib"))) {
+		CHECK(attr->val.type == TS_VECTOR);
+		CHECK(attr->val.vec_size == 3 && attr->val.vec[1] == 128.0f);
+	} else {
+		CHECK(!"vector_attrib missing");
+	}
+
+	if((arr = ts_lookup_array(tree, "rootnode.mixed", 0))) {
+		CHECK(ts_lookup(tree, "rootnode.mixed")->val.array_size == 4);
+		CHECK(arr[0].type == TS_NUMBER && arr[0].inum == 1);
+		CHECK(arr[1].type == TS_STRING && strcmp(arr[1].str, "two") == 0);
+		CHECK(arr[2].type == TS_VECTOR && arr[2].vec_size == 2);
+		CHECK(arr[3].type == TS_ARRAY && arr[3].array_size == 1);
+	} else {
+		CHECK(!"mixed missing");
+	}
+}
+
+/* save the tree with mode, load it back in all the ways available */
+static void roundtrip(struct ts_node *tree, enum ts_save_mode mode)
+{
+	char *buf;
+	long size;
+	struct ts_node *res;
+	FILE *fp;
+
+	if(!(buf = test_save_mem(tree, mode, &size))) {
+		CHECK(!"save failed");
+		return;
+	}
+	res = ts_load_mem(buf, size);
+	CHECK(res && test_cmp_tree(tree, res) == 0);
+	CHECK(res && test_check_tree(res) == 0);
+	ts_free_tree(res);
+
+	/* ts_load maps the file where possible */
+	if(!(fp = fopen(TMPFILE, "wb"))) {
+		CHECK(!"failed to create " TMPFILE);
+		free(buf);
+		return;
+	}
+	fwrite(buf, 1, size, fp);
+	fclose(fp);
+	free(buf);
+
+	res = ts_load(TMPFILE);
+	CHECK(res && test_cmp_tree(tree, res) == 0);
+	ts_free_tree(res);
+
+	if((fp = fopen(TMPFILE, "rb"))) {
+		res = ts_load_file(fp);
+		fclose(fp);
+		CHECK(res && test_cmp_tree(tree, res) == 0);
+		ts_free_tree(res);
+	}
+	remove(TMPFILE);
+}
+
+static struct ts_node *build_tree(void)
+{
+	int i;
+	char name[64];
+	struct ts_node *root, *node;
+	struct ts_attr *attr;
+	struct ts_value elem[3];
+	static const float fv[] = {0.1f, -1e-30f, 3.4e38f, 16777217.0f};
+
+	root = ts_alloc_node();
+	ts_set_node_name(root, "built");
+
+	for(i=0; i<40; i++) {
+		node = ts_alloc_node();
+		sprintf(name, "child%d", i % 7);
+		ts_set_node_name(node, name);
+
+		attr = ts_alloc_attr();
+		sprintf(name, "attr%d", i % 13);
+		ts_set_attr_name(attr, name);
+		switch(i % 5) {
+		case 0:
+			ts_set_valuei(&attr->val, i * -1000);
+			break;
+		case 1:
+			ts_set_valuef(&attr->val, fv[i % 4]);
+			break;
+		case 2:
+			ts_set_valuef_arr(&attr->val, 4, fv);
+			break;
+		case 3:
+			sprintf(name, "%0*d", i, i);
+			ts_set_value_str(&attr->val, name);
+			break;
+		default:
+			ts_init_value(elem);
+			ts_init_value(elem + 1);
+			ts_init_value(elem + 2);
+			ts_set_value_str(elem, "");
+			ts_set_valuei(elem + 1, i);
+			ts_set_valuefv(elem + 2, 2, 1.5, 2.5);
+			ts_set_value_arr(&attr->val, 3, elem);
+			ts_destroy_value(elem);
+			ts_destroy_value(elem + 1);
+			ts_destroy_value(elem + 2);
+		}
+		ts_add_attr(i & 1 ? node : root, attr);
+		ts_add_child(root, node);
+	}
+	return root;
+}
+
+int main(void)
+{
+	struct ts_node *tree;
+
+	if(!(tree = test_load_str(test_sample))) {
+		printf("failed to load the sample\n");
+		return 1;
+	}
+	check_values(tree);
+	CHECK(test_check_tree(tree) == 0);
+	roundtrip(tree, TS_TEXT);
+	roundtrip(tree, TS_BIN);
+	ts_free_tree(tree);
+
+	tree = build_tree();
+	roundtrip(tree, TS_TEXT);
+	roundtrip(tree, TS_BIN);
+	ts_free_tree(tree);
+
+	ts_set_load_flags(TS_LOAD_ARENA);
+	tree = test_load_str(test_sample);
+	ts_set_load_flags(0);
+	CHECK(tree != 0);
+	if(tree) {
+		check_values(tree);
+		roundtrip(tree, TS_BIN);
+		ts_free_tree(tree);
+	}
+
+	return test_fail ? 1 : 0;
+}
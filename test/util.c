@@ -0,0 +1,250 @@
+/*
+libtreestore - a library for reading/writing hierarchical data as text or binary
+Copyright (C) 2016-2023 John Tsiombikas <nuclear@mutantstargoat.com>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+OF SUCH DAMAGE.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+int test_fail;
+
+const char *test_sample =
+	"# a comment\n"
+	"rootnode {\n"
+	"    some_attribute = \"some_string_value\"\n"
+	"    some_numeric_attrib = 10\n"
+	"    neg = -3.5\n"
+	"    small = .25\n"
+	"    expo = -2.5e+2\n"
+	"    huge = 1e400\n"
+	"    vector_attrib = [255, 128, 0]\n"
+	"    array_attrib = [\"tom\", \"dick\", \"harry\"]\n"
+	"    mixed = [1, \"two\", [3, 4], [\"x\"]]\n"
+	"    long_string = \"this one is too long to go in the string table\"\n"
+	"    multi = \"line one\n"
+	"line two\"\n"
+	"    dash = -\n"
+	"    range = 5-3\n"
+	"    word = 1x\n"
+	"    dots = 1.2.3\n"
+	"    plus = +\n"
+	"\n"
+	"    # you can have multiple nodes with the same name\n"
+	"    childnode {\n"
+	"        childattr = \"whatever\"\n"
+	"    }\n"
+	"    childnode {\n"
+	"        another_childattr = \"xyzzy\"\n"
+	"        deep { x = 1 }\n"
+	"    }\n"
+	"    empty {\n"
+	"    }\n"
+	"    childnode { childattr = \"last\" }\n"
+	"}\n";
+
+
+static int cmp_value(struct ts_value *a, struct ts_value *b)
+{
+	int i;
+
+	if(a->type != b->type) return -1;
+
+	switch(a->type) {
+	case TS_STRING:
+		if(!a->str || !b->str) return -1;
+		return strcmp(a->str, b->str) ? -1 : 0;
+
+	case TS_NUMBER:
+		if(a->inum != b->inum) return -1;
+		if(a->fnum != b->fnum && (a->fnum == a->fnum || b->fnum == b->fnum)) {
+			return -1;
+		}
+		break;
+
+	case TS_VECTOR:
+		if(a->vec_size != b->vec_size) return -1;
+		for(i=0; i<a->vec_size; i++) {
+			if(a->vec[i] != b->vec[i]) return -1;
+		}
+		break;
+
+	case TS_ARRAY:
+		if(a->array_size != b->array_size) return -1;
+		for(i=0; i<a->array_size; i++) {
+			if(cmp_value(a->array + i, b->array + i) == -1) return -1;
+		}
+		break;
+	}
+	return 0;
+}
+
+int test_cmp_tree(struct ts_node *a, struct ts_node *b)
+{
+	struct ts_attr *aa, *ba;
+	struct ts_node *ac, *bc;
+
+	if(strcmp(a->name, b->name) != 0) {
+		printf("node name mismatch: %s/%s\n", a->name, b->name);
+		return -1;
+	}
+
+	aa = ts_get_attr_list(a);
+	ba = ts_get_attr_list(b);
+	while(aa && ba) {
+		if(strcmp(aa->name, ba->name) != 0) {
+			printf("%s: attribute name mismatch: %s/%s\n", a->name, aa->name, ba->name);
+			return -1;
+		}
+		if(cmp_value(&aa->val, &ba->val) == -1) {
+			printf("%s: value mismatch in %s\n", a->name, aa->name);
+			return -1;
+		}
+		aa = aa->next;
+		ba = ba->next;
+	}
+	if(aa || ba) {
+		printf("%s: attribute count mismatch\n", a->name);
+		return -1;
+	}
+
+	ac = ts_get_child_list(a);
+	bc = ts_get_child_list(b);
+	while(ac && bc) {
+		if(test_cmp_tree(ac, bc) == -1) {
+			return -1;
+		}
+		ac = ac->next;
+		bc = bc->next;
+	}
+	if(ac || bc) {
+		printf("%s: child count mismatch\n", a->name);
+		return -1;
+	}
+	return 0;
+}
+
+int test_check_tree(struct ts_node *tree)
+{
+	int count, err = 0;
+	struct ts_attr *attr, *first;
+	struct ts_node *c, *dup, *next;
+
+	count = 0;
+	for(attr = ts_get_attr_list(tree); attr; attr = attr->next) {
+		count++;
+		if(attr->parent != tree) err++;
+		if(!attr->next && attr != tree->attr_tail) err++;
+
+		first = tree->attr_list;
+		while(strcmp(first->name, attr->name) != 0) {
+			first = first->next;
+		}
+		if(ts_get_attr(tree, attr->name) != first) err++;
+		if(attr->name_atom > 0 && ts_get_attr_atom(tree, attr->name_atom) != first) err++;
+	}
+	if(count != tree->attr_count) err++;
+
+	count = 0;
+	for(c = ts_get_child_list(tree); c; c = c->next) {
+		count++;
+		if(c->parent != tree) err++;
+		if(!c->next && c != tree->child_tail) err++;
+
+		/* the first child with this name, and the same-named ones after it */
+		dup = tree->child_list;
+		while(strcmp(dup->name, c->name) != 0) {
+			dup = dup->next;
+		}
+		if(dup == c) {
+			next = ts_get_child(tree, c->name);
+			while(dup) {
+				if(next != dup) {
+					err++;
+					break;
+				}
+				next = ts_get_next_child(next);
+				do {
+					dup = dup->next;
+				} while(dup && strcmp(dup->name, c->name) != 0);
+			}
+			if(next) err++;
+		}
+
+		err += test_check_tree(c);
+	}
+	if(count != tree->child_count) err++;
+	return err;
+}
+
+
+struct membuf {
+	char *buf;
+	long size, max;
+};
+
+static long mem_write(const void *buf, size_t bytes, void *uptr)
+{
+	struct membuf *mb = uptr;
+	char *tmp;
+	long newmax;
+
+	if(mb->size + (long)bytes > mb->max) {
+		newmax = mb->max ? mb->max * 2 : 256;
+		while(newmax < mb->size + (long)bytes) newmax *= 2;
+		if(!(tmp = realloc(mb->buf, newmax))) {
+			return -1;
+		}
+		mb->buf = tmp;
+		mb->max = newmax;
+	}
+	memcpy(mb->buf + mb->size, buf, bytes);
+	mb->size += bytes;
+	return bytes;
+}
+
+char *test_save_mem(struct ts_node *tree, enum ts_save_mode mode, long *size)
+{
+	struct ts_io io = {0};
+	struct membuf mb = {0};
+	enum ts_save_mode prev_mode = ts_get_save_mode();
+
+	io.data = &mb;
+	io.write = mem_write;
+
+	ts_set_save_mode(mode);
+	if(ts_save_io(tree, &io) == -1) {
+		ts_set_save_mode(prev_mode);
+		free(mb.buf);
+		return 0;
+	}
+	ts_set_save_mode(prev_mode);
+	*size = mb.size;
+	return mb.buf;
+}
+
+struct ts_node *test_load_str(const char *str)
+{
+	return ts_load_mem(str, strlen(str));
+}